@@ -0,0 +1,2 @@
+g++ -O2 src/bench/lexer_bench.cpp src/source.cpp src/compiler/lexer.cpp src/compiler/scanner.cpp -pthread -o compilers/lexer_bench.out
+g++ -O2 src/bench/parser_bench.cpp src/compiler/lexer.cpp src/compiler/scanner.cpp src/compiler/parser.cpp -pthread -o compilers/parser_bench.out
@@ -1,2 +1,2 @@
-g++ src/main.cpp src/vm.cpp src/compiler/lexer.cpp src/compiler/parser.cpp src/compiler/compiler_main.cpp -o compilers/femira.out
-x86_64-w64-mingw32-c++ src/main.cpp src/vm.cpp src/compiler/lexer.cpp src/compiler/parser.cpp src/compiler/compiler_main.cpp -o compilers/femira.exe
\ No newline at end of file
+g++ src/main.cpp src/source.cpp src/vm.cpp src/compiler/lexer.cpp src/compiler/scanner.cpp src/compiler/parser.cpp src/compiler/compiler_main.cpp src/compiler/optimizer.cpp src/compiler/register_ir.cpp -pthread -o compilers/femira.out
+x86_64-w64-mingw32-c++ src/main.cpp src/source.cpp src/vm.cpp src/compiler/lexer.cpp src/compiler/scanner.cpp src/compiler/parser.cpp src/compiler/compiler_main.cpp src/compiler/optimizer.cpp src/compiler/register_ir.cpp -pthread -o compilers/femira.exe
\ No newline at end of file
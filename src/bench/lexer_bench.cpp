@@ -0,0 +1,254 @@
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../include/source.h"
+#include "../compiler/include/lexer.h"
+#include "../compiler/include/scanner.h"
+
+using namespace std;
+
+// Usage: lexer_bench [file.fmr ...]
+// Before timing anything the lexer paths that must agree with make_tokens are
+// checked against it; a mismatch is reported and the exit code is 1.
+// Without files two synthetic scripts of a few megabytes are lexed instead: one of
+// short tokens, where the scalar loop does most of the work, and one of long
+// strings and indentation, the runs the vector kernels are for.
+
+string repeat_snippet(const string& snippet, size_t target_size)
+{
+    string code;
+    code.reserve(target_size + snippet.size());
+
+    while (code.size() < target_size) code += snippet;
+
+    return code;
+}
+
+string make_synthetic_script(size_t target_size)
+{
+    string snippet =
+        "fn accumulate_values(first_value: int, second_value: int) -> int {\n"
+        "    result_value := first_value * 2 + second_value\n"
+        "    if result_value > 1000 {\n"
+        "        print \"accumulated value is larger than the expected threshold\"\n"
+        "    }\n"
+        "    return result_value\n"
+        "}\n"
+        "configuration := { name := \"generated configuration entry\", size := 42, ratio := 0.75 }\n"
+        "values := [1, 2, 3, 4, 5, 6, 7, 8, 9, 10]\n"
+        "                counter := counter + accumulate_values(values[1], configuration[\"size\"])\n\n";
+
+    return repeat_snippet(snippet, target_size);
+}
+
+string make_long_runs_script(size_t target_size)
+{
+    string snippet =
+        "                        description_of_the_generated_entry := \"lorem ipsum dolor sit amet, consectetur adipiscing elit, "
+        "sed do eiusmod tempor incididunt ut labore et dolore magna aliqua\"\n";
+
+    return repeat_snippet(snippet, target_size);
+}
+
+bool is_same_token(const Token& token_1, const Token& token_2)
+{
+    return token_1.type == token_2.type && token_1.value == token_2.value && token_1.position == token_2.position
+        && token_1.is_integer == token_2.is_integer && token_1.integer_value == token_2.integer_value && token_1.double_value == token_2.double_value;
+}
+
+// index of the first token that differs, -1 when the streams are the same
+int first_difference(const vector<Token>& tokens_1, const vector<Token>& tokens_2)
+{
+    size_t common = min(tokens_1.size(), tokens_2.size());
+
+    for (size_t i = 0; i < common; i++)
+    {
+        if (!is_same_token(tokens_1[i], tokens_2[i])) return i;
+    }
+
+    return tokens_1.size() == tokens_2.size() ? -1 : common;
+}
+
+// Lexes code in full, or gives the error the lexer stopped with
+vector<Token> lex_or_error(string_view code, string& error)
+{
+    try
+    {
+        Lexer lexer(code, false);
+        return lexer.make_tokens();
+    } catch (const runtime_error& exception)
+    {
+        error = exception.what();
+    }
+
+    return {};
+}
+
+// Random edits of code, each relexed from the tokens before it and compared
+// with a fresh make_tokens of the edited code
+bool check_relex(string code, int edits_count)
+{
+    const vector<string> fragments = { "", "x", "_1", " ", "\n", "42", "3.5", ":=", "?=", "<", "=", "\"", "\"text\"", "(", "}", "fn f(a: int) -> int { return a }" };
+
+    mt19937 random(12345);
+
+    string error;
+    vector<Token> tokens = lex_or_error(code, error);
+    if (!error.empty()) return true;
+
+    for (int edit = 0; edit < edits_count; edit++)
+    {
+        int edit_position = random() % (code.size() + 1);
+        int removed_length = min<int>(random() % 9, code.size() - edit_position);
+        const string& inserted = fragments[random() % fragments.size()];
+
+        string edited = code.substr(0, edit_position) + inserted + code.substr(edit_position + removed_length);
+
+        string fresh_error;
+        vector<Token> fresh = lex_or_error(edited, fresh_error);
+
+        string relex_error;
+        vector<Token> relexed;
+
+        try
+        {
+            Lexer lexer(edited, false);
+            relexed = lexer.relex(tokens, edit_position, removed_length, inserted.size());
+        } catch (const runtime_error& exception)
+        {
+            relex_error = exception.what();
+        }
+
+        // an edit that leaves a string unclosed is an error both ways, the next edit starts from the old code
+        if (!fresh_error.empty() || !relex_error.empty())
+        {
+            if (fresh_error.empty() || relex_error.empty())
+            {
+                cerr << "relex: edit " << edit << " at " << edit_position << " fails only "
+                     << (fresh_error.empty() ? "when relexed: " + relex_error : "when lexed in full: " + fresh_error) << endl;
+                return false;
+            }
+
+            continue;
+        }
+
+        int difference = first_difference(fresh, relexed);
+
+        if (difference >= 0)
+        {
+            cerr << "relex: edit " << edit << " at " << edit_position << " (removed " << removed_length << ", inserted \"" << inserted
+                 << "\") differs from make_tokens at token " << difference << endl;
+            return false;
+        }
+
+        code = move(edited);
+        tokens = move(fresh);
+    }
+
+    cout << "  relex: " << edits_count << " edits match make_tokens" << endl;
+
+    return true;
+}
+
+// make_tokens_parallel has to give exactly the tokens make_tokens gives, for any
+// number of threads
+bool check_parallel_lexing(const string& name, string_view code)
+{
+    Lexer serial_lexer(code, false);
+    vector<Token> serial = serial_lexer.make_tokens();
+
+    for (unsigned int threads_count: { 2u, 3u, 4u, 8u, 16u })
+    {
+        Lexer parallel_lexer(code, false);
+        int difference = first_difference(serial, parallel_lexer.make_tokens_parallel(threads_count));
+
+        if (difference >= 0)
+        {
+            cerr << "parallel lexing of " << name << " on " << threads_count << " threads differs from make_tokens at token " << difference << endl;
+            return false;
+        }
+    }
+
+    cout << "  parallel lexing of " << name << ": " << serial.size() << " tokens match make_tokens" << endl;
+
+    return true;
+}
+
+void bench_source(const string& name, string_view code)
+{
+    const int iterations = 5;
+
+    cout << name << " (" << code.size() << " bytes)" << endl;
+
+    size_t reference_count = 0;
+
+    for (int kernel = SCAN_SCALAR; kernel <= best_scanner_kernel(); kernel++)
+    {
+        set_scanner_kernel(ScannerKernel(kernel));
+
+        double best_seconds = 0;
+        size_t tokens_count = 0;
+
+        for (int i = 0; i < iterations; i++)
+        {
+            auto started = chrono::steady_clock::now();
+
+            Lexer lexer(code, false);
+            tokens_count = lexer.make_tokens().size();
+
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            if (i == 0 || seconds < best_seconds) best_seconds = seconds;
+        }
+
+        if (kernel == SCAN_SCALAR) reference_count = tokens_count;
+        else if (tokens_count != reference_count) cerr << "  token count mismatch with scalar kernel" << endl;
+
+        cout << "  " << scanner_kernel_name(ScannerKernel(kernel)) << ": "
+             << code.size() / best_seconds / (1024 * 1024) << " MB/s, "
+             << tokens_count << " tokens" << endl;
+    }
+
+    set_scanner_kernel(best_scanner_kernel());
+}
+
+int main(int argc, char** argv)
+{
+    const int relex_edits = 500;
+
+    if (argc < 2)
+    {
+        cout << "checks" << endl;
+        if (!check_relex(make_synthetic_script(64 * 1024), relex_edits)) return 1;
+
+        string code = make_synthetic_script(8 * 1024 * 1024);
+        string long_runs = make_long_runs_script(8 * 1024 * 1024);
+
+        if (!check_parallel_lexing("synthetic", code) || !check_parallel_lexing("synthetic long runs", long_runs)) return 1;
+
+        bench_source("synthetic", code);
+        bench_source("synthetic long runs", long_runs);
+
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        SourceFile source;
+
+        if (!source.load(argv[i]))
+        {
+            cerr << "Cannot open " << argv[i] << endl;
+            return 1;
+        }
+
+        bench_source(argv[i], source.view());
+
+        if (!check_relex(string(source.view()), relex_edits) || !check_parallel_lexing(argv[i], source.view())) return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,237 @@
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+
+#include "../compiler/include/lexer.h"
+#include "../compiler/include/parser.h"
+
+using namespace std;
+
+// Usage: parser_bench
+// Parses generated expressions of growing size; with a linear parser the
+// time per token stays flat as nesting depth and chain length grow.
+// First make_ast_parallel is checked against make_ast on a generated script of a
+// few megabytes; a mismatch is reported and the exit code is 1.
+
+string nested_parentheses(int depth)
+{
+    string code = "x := ";
+
+    for (int i = 0; i < depth; i++) code += "(";
+    code += "a";
+    for (int i = 0; i < depth; i++) code += " + 1)";
+
+    return code;
+}
+
+string nested_calls(int depth)
+{
+    string code = "x := ";
+
+    for (int i = 0; i < depth; i++) code += "f(a * 2, ";
+    code += "b";
+    for (int i = 0; i < depth; i++) code += ")[1]";
+
+    return code;
+}
+
+string operator_chain(int length)
+{
+    string code = "x := a";
+
+    for (int i = 0; i < length; i++) code += i % 3 == 0 ? " + b * c" : (i % 3 == 1 ? " - d / e" : " < f & g");
+
+    return code;
+}
+
+string generated_program(size_t target_size)
+{
+    string code;
+    int i = 0;
+
+    while (code.size() < target_size)
+    {
+        string n = to_string(i++);
+
+        code +=
+            "typedef Pair" + n + " := { left := int, right := int }\n"
+            "fn step" + n + "(a: int, b: int) -> int {\n"
+            "    total := a * " + n + " + b / 2 - (a + b) * 3\n"
+            "    while total > 100 { total := total - 7 }\n"
+            "    if total ?= 4 { print \"four\" } else { total := total + 1 }\n"
+            "    return total\n"
+            "}\n"
+            "values" + n + " := [1, 2.5, \"three\", true, nil, step" + n + "(1, 2)]\n"
+            "record" + n + " := { left := values" + n + "[0], right := step" + n + "(3, values" + n + "[0]) - 1 }\n"
+            "record" + n + "[\"left\"] := record" + n + "[\"right\"] < 5 & " + n + " >= 2 | false\n";
+    }
+
+    return code;
+}
+
+// Whole AST as text, deferred function bodies parsed first
+string dump_ast(Parser& parser, AstNode* node)
+{
+    if (!node) return "_";
+
+    auto token_text = [](Token* token) { return string(token->value) + "@" + to_string(token->position); };
+
+    switch (node->kind)
+    {
+        case NODE_PARENTHISIZED:
+            return "(" + dump_ast(parser, static_cast<ParenthisizedNode*>(node)->wrapped) + ")";
+        case NODE_IDENTIFIER:
+            {
+                IdentifierNode* identifier = static_cast<IdentifierNode*>(node);
+                return token_text(identifier->token) + (identifier->type ? ":" + dump_ast(parser, identifier->type) : "");
+            }
+        case NODE_LITERAL:
+            return "'" + token_text(static_cast<LiteralNode*>(node)->token);
+        case NODE_BINARY_OPERATION:
+            {
+                BinaryOperationNode* binary = static_cast<BinaryOperationNode*>(node);
+                return "[" + dump_ast(parser, binary->left_operand) + " " + token_text(binary->operator_token) + " " + dump_ast(parser, binary->right_operand) + "]";
+            }
+        case NODE_UNARY_OPERATION:
+            {
+                UnaryOperationNode* unary = static_cast<UnaryOperationNode*>(node);
+                return "[" + token_text(unary->token) + " " + dump_ast(parser, unary->operand) + "]";
+            }
+        case NODE_INDEXATION:
+            {
+                IndexationNode* indexation = static_cast<IndexationNode*>(node);
+                return dump_ast(parser, indexation->where) + "[" + dump_ast(parser, indexation->index) + "]";
+            }
+        case NODE_ARRAY:
+            {
+                string text = "array(";
+                for (AstNode* element: static_cast<ArrayNode*>(node)->elements) text += dump_ast(parser, element) + ",";
+                return text + ")";
+            }
+        case NODE_OBJECT:
+            {
+                string text = "object(";
+                for (AstNode* field: static_cast<ObjectNode*>(node)->fields) text += dump_ast(parser, field) + ",";
+                return text + ")";
+            }
+        case NODE_BLOCK:
+            {
+                BlockNode* block = static_cast<BlockNode*>(node);
+                if (block->deferred_by) block->deferred_by->parse_deferred(block);
+
+                string text = "{\n";
+                for (AstNode* statement: block->nodes) text += dump_ast(parser, statement) + "\n";
+                return text + "}";
+            }
+        case NODE_IF:
+            {
+                IfNode* if_node = static_cast<IfNode*>(node);
+                return "if " + dump_ast(parser, if_node->condition) + dump_ast(parser, if_node->success_block) + " else " + dump_ast(parser, if_node->fail_block);
+            }
+        case NODE_WHILE:
+            {
+                WhileNode* while_node = static_cast<WhileNode*>(node);
+                return "while " + dump_ast(parser, while_node->condition) + dump_ast(parser, while_node->block);
+            }
+        case NODE_FUNCTION:
+            {
+                FunctionNode* function = static_cast<FunctionNode*>(node);
+
+                string text = "fn " + dump_ast(parser, function->id) + "(";
+                for (IdentifierNode* argument: function->needed_arguments) text += dump_ast(parser, argument) + ",";
+                return text + ") -> " + dump_ast(parser, function->return_type) + dump_ast(parser, function->block);
+            }
+        case NODE_TYPEDEF:
+            {
+                TypedefNode* typedef_node = static_cast<TypedefNode*>(node);
+                return "typedef " + dump_ast(parser, typedef_node->id) + " = " + dump_ast(parser, typedef_node->type);
+            }
+        case NODE_CALL:
+            {
+                CallNode* call = static_cast<CallNode*>(node);
+
+                string text = dump_ast(parser, call->to_call) + "(";
+                for (AstNode* argument: call->with_args) text += dump_ast(parser, argument) + ",";
+                return text + ")";
+            }
+        default:
+            return "?";
+    }
+}
+
+bool check_parallel_parsing(const string& code)
+{
+    Lexer lexer(code, false);
+    vector<Token> tokens = lexer.make_tokens();
+
+    for (bool lazy_functions: { false, true })
+    {
+        Parser serial_parser(tokens, lazy_functions);
+        string serial = dump_ast(serial_parser, serial_parser.make_ast(false));
+
+        for (unsigned int threads_count: { 2u, 4u, 8u, 16u })
+        {
+            Parser parallel_parser(tokens, lazy_functions);
+
+            if (dump_ast(parallel_parser, parallel_parser.make_ast_parallel(false, threads_count)) != serial)
+            {
+                cerr << "parallel parsing on " << threads_count << " threads" << (lazy_functions ? " with lazy functions" : "") << " differs from make_ast" << endl;
+                return false;
+            }
+        }
+    }
+
+    cout << "parallel parsing of " << code.size() << " bytes (" << tokens.size() << " tokens) matches make_ast" << endl;
+
+    return true;
+}
+
+void bench_shape(const string& name, function<string(int)> generate, int sizes[], int sizes_count)
+{
+    cout << name << endl;
+
+    for (int i = 0; i < sizes_count; i++)
+    {
+        string code = generate(sizes[i]);
+
+        Lexer lexer(code, false);
+        vector<Token> tokens = lexer.make_tokens();
+        size_t tokens_count = tokens.size();
+
+        auto started = chrono::steady_clock::now();
+
+        Parser parser(move(tokens));
+        parser.make_ast(false);
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        cout << "  size " << sizes[i] << ": " << tokens_count << " tokens, "
+             << seconds * 1000 << " ms, " << seconds * 1e9 / tokens_count << " ns/token" << endl;
+
+        // the streaming parser lexes on demand, so its time includes lexing
+        started = chrono::steady_clock::now();
+
+        Lexer streamed_lexer(code, false);
+        Parser streamed_parser(&streamed_lexer);
+        streamed_parser.make_ast(false);
+
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        cout << "    streamed (with lexing): " << seconds * 1000 << " ms, " << seconds * 1e9 / tokens_count << " ns/token" << endl;
+    }
+}
+
+int main()
+{
+    if (!check_parallel_parsing(generated_program(4 * 1024 * 1024))) return 1;
+
+    int depths[] = { 250, 500, 1000, 2000 };
+    int lengths[] = { 10000, 20000, 40000, 80000 };
+
+    bench_shape("nested parentheses", nested_parentheses, depths, 4);
+    bench_shape("nested calls", nested_calls, depths, 4);
+    bench_shape("operator chain", operator_chain, lengths, 4);
+
+    return 0;
+}
@@ -1,5 +1,7 @@
 #include <vector>
 #include <string>
+#include <functional>
+#include <algorithm>
 
 #include "include/parser.h"
 #include "../include/vm.h"
@@ -7,331 +9,1802 @@
 
 using namespace std;
 
-vector<Instruction> CompilerMain::get_generated_bytecode()
+CompilerMain::CompilerMain(Scope* scope, Inliner* inliner, ConstantPool* constants, RecordTypes* records)
 {
-    return this->generated;
+    if (!scope)
+    {
+        this->top_level_scope = make_unique<Scope>();
+        scope = this->top_level_scope.get();
+    }
+
+    if (!inliner)
+    {
+        this->top_level_inliner = make_unique<Inliner>();
+        inliner = this->top_level_inliner.get();
+    }
+
+    if (!constants)
+    {
+        this->top_level_constants = make_unique<ConstantPool>();
+        constants = this->top_level_constants.get();
+    }
+
+    if (!records)
+    {
+        this->top_level_records = make_unique<RecordTypes>();
+        records = this->top_level_records.get();
+    }
+
+    this->scope = scope;
+    this->inliner = inliner;
+    this->constants = constants;
+    this->records = records;
+}
+
+Bytecode CompilerMain::get_generated_bytecode()
+{
+    return move(this->generated);
+}
+
+int CompilerMain::get_locals_count()
+{
+    return this->scope->locals_count;
+}
+
+void CompilerMain::set_inline_threshold(int threshold)
+{
+    this->inliner->threshold = threshold;
+}
+
+void CompilerMain::set_optimization_level(int level)
+{
+    this->inliner->is_hoisting = level > 0;
+}
+
+const vector<string>& CompilerMain::get_inlined_calls()
+{
+    return this->inliner->report;
+}
+
+const ConstantPool& CompilerMain::get_constant_pool()
+{
+    return *this->constants;
+}
+
+void CompilerMain::emit_constant(Opcode opcode, Object* data)
+{
+    // functions are values with their own state, they are never shared
+    int index = dynamic_cast<Function*>(data) ? this->constants->add(data) : this->constants->intern(data);
+
+    this->generated.push_back(Instruction(opcode, index));
+}
+
+void CompilerMain::emit_name(Opcode opcode, const string& name)
+{
+    this->generated.push_back(Instruction(opcode, this->constants->intern_string(name)));
+}
+
+// Jump operands are relative: the VM adds them to the jump's own index before
+// stepping to the next instruction.
+int CompilerMain::emit_jump(Opcode opcode)
+{
+    this->generated.push_back(Instruction(opcode, 0));
+
+    return this->generated.size() - 1;
+}
+
+void CompilerMain::bind_jump(int jump)
+{
+    this->generated[jump].operand = this->generated.size() - jump - 1;
+}
+
+// jumps over what follows when condition is false; boolean conditions skip the type check
+int CompilerMain::emit_condition_jump(AstNode* condition)
+{
+    return this->emit_jump(is_named_type(this->get_node_type(condition), "bool") ? OP_JUMPIFNOT_BOOL : OP_JUMPIFNOT);
+}
+
+void CompilerMain::emit_jump_to(Opcode opcode, int target)
+{
+    this->generated.push_back(Instruction(opcode, target - int(this->generated.size()) - 1));
+}
+
+LiteralType int_type("int");
+LiteralType double_type("double");
+LiteralType string_type("string");
+LiteralType bool_type("bool");
+LiteralType nil_type("nil");
+
+// while local types are inferred, the type of a local nothing was assigned to yet
+LiteralType unassigned_type("");
+
+bool is_named_type(Type* type, const string& name)
+{
+    return type && type->kind == TYPE_LITERAL && static_cast<LiteralType*>(type)->value == name;
+}
+
+bool is_same_type(Type* type_1, Type* type_2)
+{
+    if (type_1 == type_2) return true;
+    if (!type_1 || !type_2 || type_1->kind != type_2->kind) return false;
+
+    switch (type_1->kind)
+    {
+        case TYPE_LITERAL:
+            return static_cast<LiteralType*>(type_1)->value == static_cast<LiteralType*>(type_2)->value;
+        case TYPE_POINTER:
+            return is_same_type(static_cast<PointerType*>(type_1)->value, static_cast<PointerType*>(type_2)->value);
+        case TYPE_ARRAY:
+            return is_same_type(static_cast<ArrayType*>(type_1)->can_store, static_cast<ArrayType*>(type_2)->can_store);
+        case TYPE_OBJECT:
+            {
+                map<string, Type*>& fields_1 = static_cast<ObjectType*>(type_1)->fields;
+                map<string, Type*>& fields_2 = static_cast<ObjectType*>(type_2)->fields;
+
+                if (fields_1.size() != fields_2.size()) return false;
+
+                for (pair<const string, Type*>& field: fields_1)
+                {
+                    auto other = fields_2.find(field.first);
+                    if (other == fields_2.end() || !is_same_type(field.second, other->second)) return false;
+                }
+
+                return true;
+            }
+        case TYPE_FUNCTION:
+            {
+                FunctionType* function_1 = static_cast<FunctionType*>(type_1);
+                FunctionType* function_2 = static_cast<FunctionType*>(type_2);
+
+                if (!is_same_type(function_1->returns, function_2->returns) || function_1->args.size() != function_2->args.size()) return false;
+
+                for (size_t i = 0; i < function_1->args.size(); i++)
+                {
+                    if (!is_same_type(function_1->args[i], function_2->args[i])) return false;
+                }
+
+                return true;
+            }
+        default:
+            return false;
+    }
+}
+
+// Type written in an annotation: a name, [element type] or { field := type }
+Type* annotation_to_type(AstNode* annotation)
+{
+    switch (annotation->kind)
+    {
+        case NODE_IDENTIFIER:
+            {
+                string name(static_cast<IdentifierNode*>(annotation)->token->value);
+
+                if (name == "boolean") name = "bool";
+
+                return new LiteralType(name);
+            }
+        case NODE_LITERAL:
+            {
+                if (static_cast<LiteralNode*>(annotation)->token->type == NIL) return &nil_type;
+            }
+            break;
+        case NODE_ARRAY:
+            {
+                ArrayNode* array = static_cast<ArrayNode*>(annotation);
+
+                if (array->elements.size() == 1) return new ArrayType(annotation_to_type(array->elements[0]));
+            }
+            break;
+        case NODE_OBJECT:
+            {
+                map<string, Type*> fields;
+
+                for (AstNode* field: static_cast<ObjectNode*>(annotation)->fields)
+                {
+                    BinaryOperationNode* assignment = node_cast<BinaryOperationNode>(field);
+                    IdentifierNode* name = assignment ? node_cast<IdentifierNode>(assignment->left_operand) : nullptr;
+
+                    if (!name || assignment->operator_token->type != ASSIGN) return nullptr;
+
+                    fields[string(name->token->value)] = annotation_to_type(assignment->right_operand);
+                }
+
+                return new ObjectType(fields);
+            }
+        default:
+            break;
+    }
+
+    return nullptr;
+}
+
+// Common type of two values, nullptr when they may differ
+Type* meet_types(Type* type_1, Type* type_2)
+{
+    if (type_1 == &unassigned_type) return type_2;
+    if (type_2 == &unassigned_type) return type_1;
+
+    if (!type_1 || !type_2 || !is_same_type(type_1, type_2)) return nullptr;
+
+    return type_1;
+}
+
+// Calls visit for every subexpression evaluated as part of node, nested function
+// bodies included; the names of object fields and annotations are not expressions.
+// Lazy bodies that are not parsed yet have no children.
+void visit_children(AstNode* node, const function<void(AstNode*)>& visit)
+{
+    switch (node->kind)
+    {
+        case NODE_BINARY_OPERATION:
+            {
+                BinaryOperationNode* binary = static_cast<BinaryOperationNode*>(node);
+
+                visit(binary->left_operand);
+                visit(binary->right_operand);
+            }
+            break;
+        case NODE_UNARY_OPERATION:
+            {
+                visit(static_cast<UnaryOperationNode*>(node)->operand);
+            }
+            break;
+        case NODE_PARENTHISIZED:
+            {
+                visit(static_cast<ParenthisizedNode*>(node)->wrapped);
+            }
+            break;
+        case NODE_INDEXATION:
+            {
+                IndexationNode* indexation = static_cast<IndexationNode*>(node);
+
+                visit(indexation->where);
+                visit(indexation->index);
+            }
+            break;
+        case NODE_ARRAY:
+            {
+                for (AstNode* element: static_cast<ArrayNode*>(node)->elements) visit(element);
+            }
+            break;
+        case NODE_OBJECT:
+            {
+                for (AstNode* field: static_cast<ObjectNode*>(node)->fields)
+                {
+                    BinaryOperationNode* assignment = node_cast<BinaryOperationNode>(field);
+
+                    if (assignment && assignment->operator_token->type == ASSIGN) visit(assignment->right_operand);
+                    else visit(field);
+                }
+            }
+            break;
+        case NODE_CALL:
+            {
+                CallNode* call = static_cast<CallNode*>(node);
+
+                visit(call->to_call);
+                for (AstNode* argument: call->with_args) visit(argument);
+            }
+            break;
+        case NODE_IF:
+            {
+                IfNode* if_statement = static_cast<IfNode*>(node);
+
+                visit(if_statement->condition);
+                visit(if_statement->success_block);
+                visit(if_statement->fail_block);
+            }
+            break;
+        case NODE_WHILE:
+            {
+                WhileNode* while_node = static_cast<WhileNode*>(node);
+
+                visit(while_node->condition);
+                visit(while_node->block);
+            }
+            break;
+        case NODE_BLOCK:
+            {
+                for (AstNode* child: static_cast<BlockNode*>(node)->nodes) visit(child);
+            }
+            break;
+        case NODE_FUNCTION:
+            {
+                visit(static_cast<FunctionNode*>(node)->block);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// `name := value` nodes of one function body, without the nested functions
+void collect_assignments(AstNode* node, vector<BinaryOperationNode*>& assignments)
+{
+    if (node->kind == NODE_FUNCTION) return;
+
+    if (BinaryOperationNode* binary = node_cast<BinaryOperationNode>(node))
+    {
+        if (binary->operator_token->type == ASSIGN && node_cast<IdentifierNode>(binary->left_operand)) assignments.push_back(binary);
+    }
+
+    visit_children(node, [&assignments](AstNode* child) { collect_assignments(child, assignments); });
+}
+
+bool CompilerMain::is_types_compatible(AstNode* node_1, AstNode* node_2)
+{
+    Type* type_1 = this->get_node_type(node_1);
+    Type* type_2 = this->get_node_type(node_2);
+
+    return !type_1 || !type_2 || is_same_type(type_1, type_2);
+}
+
+Type* CompilerMain::get_node_type(AstNode* node)
+{
+    switch (node->kind)
+    {
+        case NODE_LITERAL:
+            {
+                Token* token = static_cast<LiteralNode*>(node)->token;
+
+                switch (token->type)
+                {
+                    case DIGIT:
+                        return token->is_integer ? &int_type : &double_type;
+                    case TRUE:
+                    case FALSE:
+                        return &bool_type;
+                    case STRING:
+                        return &string_type;
+                    case NIL:
+                        return &nil_type;
+                    default:
+                        return nullptr;
+                }
+            }
+        case NODE_PARENTHISIZED:
+            return this->get_node_type(static_cast<ParenthisizedNode*>(node)->wrapped);
+        case NODE_IDENTIFIER:
+            {
+                string name(static_cast<IdentifierNode*>(node)->token->value);
+
+                auto inlined = this->inlined_arguments.find(name);
+                if (inlined != this->inlined_arguments.end()) return inlined->second.type;
+
+                // only slot locals are out of reach of other code
+                if (!this->scope->slots.count(name)) return nullptr;
+
+                auto local_type = this->scope->local_types.find(name);
+                if (local_type != this->scope->local_types.end()) return local_type->second;
+
+                return this->scope->is_inferring ? &unassigned_type : nullptr;
+            }
+        case NODE_BINARY_OPERATION:
+            return this->get_binary_type(static_cast<BinaryOperationNode*>(node));
+        default:
+            return nullptr;
+    }
+}
+
+Type* CompilerMain::get_binary_type(BinaryOperationNode* binary)
+{
+    switch (binary->operator_token->type)
+    {
+        // these either give a boolean or stop the VM
+        case EQ:
+        case NOTEQ:
+        case AND:
+        case OR:
+        case BIGGER:
+        case SMALLER:
+        case BIGGER_OR_EQ:
+        case SMALLER_OR_EQ:
+            return &bool_type;
+        case PLUS:
+        case MINUS:
+        case ASTERISK:
+        case SLASH:
+            {
+                Type* operands = meet_types(this->get_node_type(binary->left_operand), this->get_node_type(binary->right_operand));
+
+                if (operands == &unassigned_type || is_named_type(operands, "int") || is_named_type(operands, "double")) return operands;
+
+                return nullptr;
+            }
+        default:
+            return nullptr;
+    }
+}
+
+// Optimistic fixpoint: every local starts as unassigned and is narrowed by the types
+// of the values stored into it until nothing changes. Locals end up typed only when
+// every store into them has the same static type.
+void CompilerMain::infer_local_types(BlockNode* body, const map<string, Type*>& parameter_types)
+{
+    vector<BinaryOperationNode*> assignments;
+    collect_assignments(body, assignments);
+
+    this->scope->local_types.clear();
+    this->scope->is_inferring = true;
+
+    while (true)
+    {
+        map<string, Type*> inferred;
+
+        for (const pair<const string, Type*>& parameter: parameter_types)
+        {
+            if (this->scope->slots.count(parameter.first)) inferred[parameter.first] = parameter.second;
+        }
+
+        for (BinaryOperationNode* assignment: assignments)
+        {
+            string name(static_cast<IdentifierNode*>(assignment->left_operand)->token->value);
+            if (!this->scope->slots.count(name)) continue;
+
+            auto current = inferred.find(name);
+            Type* stored = current != inferred.end() ? current->second : &unassigned_type;
+
+            inferred[name] = meet_types(stored, this->get_node_type(assignment->right_operand));
+        }
+
+        if (inferred == this->scope->local_types) break;
+
+        this->scope->local_types = inferred;
+    }
+
+    for (pair<const string, Type*>& local_type: this->scope->local_types)
+    {
+        if (local_type.second == &unassigned_type) local_type.second = nullptr;
+    }
+
+    this->scope->is_inferring = false;
+}
+
+// Swaps the generic opcode just emitted for binary with a variant that trusts the
+// operand types, when both are statically int or both double.
+void CompilerMain::specialize_binary(BinaryOperationNode* binary)
+{
+    Type* left_type = this->get_node_type(binary->left_operand);
+    Type* right_type = this->get_node_type(binary->right_operand);
+
+    bool is_int = is_named_type(left_type, "int") && is_named_type(right_type, "int");
+    bool is_double = is_named_type(left_type, "double") && is_named_type(right_type, "double");
+
+    if (!is_int && !is_double) return;
+
+    Instruction& operation = this->generated.back();
+
+    switch (operation.opcode)
+    {
+        case OP_ADD:
+            operation.opcode = is_int ? OP_ADD_INT : OP_ADD_DOUBLE;
+            break;
+        case OP_SUB:
+            operation.opcode = is_int ? OP_SUB_INT : OP_SUB_DOUBLE;
+            break;
+        case OP_MUL:
+            operation.opcode = is_int ? OP_MUL_INT : OP_MUL_DOUBLE;
+            break;
+        case OP_DIV:
+            operation.opcode = is_int ? OP_DIV_INT : OP_DIV_DOUBLE;
+            break;
+        case OP_SMALLER:
+            operation.opcode = is_int ? OP_LT_INT : OP_LT_DOUBLE;
+            break;
+        case OP_BIGGER:
+            operation.opcode = is_int ? OP_GT_INT : OP_GT_DOUBLE;
+            break;
+        case OP_SMALLEROREQ:
+            operation.opcode = is_int ? OP_LE_INT : OP_LE_DOUBLE;
+            break;
+        case OP_BIGGEROREQ:
+            operation.opcode = is_int ? OP_GE_INT : OP_GE_DOUBLE;
+            break;
+        default:
+            break;
+    }
+}
+
+struct ScopeNames
+{
+    set<string> written;
+    set<string> declared;
+
+    // every name used inside nested functions, which can only reach them through Memory
+    set<string> captured;
+
+    // a nested function body is not parsed yet, so it may use any name
+    bool is_capturing_all = false;
+};
+
+void collect_scope_names(AstNode* node, ScopeNames& names, bool is_nested)
+{
+    switch (node->kind)
+    {
+        case NODE_IDENTIFIER:
+            {
+                IdentifierNode* identifier = static_cast<IdentifierNode*>(node);
+
+                if (is_nested) names.captured.insert(string(identifier->token->value));
+            }
+            break;
+        case NODE_BINARY_OPERATION:
+            {
+                BinaryOperationNode* binary = static_cast<BinaryOperationNode*>(node);
+
+                IdentifierNode* identifier = node_cast<IdentifierNode>(binary->left_operand);
+
+                if (identifier && binary->operator_token->type == ASSIGN)
+                {
+                    (is_nested ? names.captured : names.written).insert(string(identifier->token->value));
+                } else collect_scope_names(binary->left_operand, names, is_nested);
+
+                collect_scope_names(binary->right_operand, names, is_nested);
+            }
+            break;
+        case NODE_UNARY_OPERATION:
+            {
+                collect_scope_names(static_cast<UnaryOperationNode*>(node)->operand, names, is_nested);
+            }
+            break;
+        case NODE_PARENTHISIZED:
+            {
+                collect_scope_names(static_cast<ParenthisizedNode*>(node)->wrapped, names, is_nested);
+            }
+            break;
+        case NODE_INDEXATION:
+            {
+                IndexationNode* indexation = static_cast<IndexationNode*>(node);
+
+                collect_scope_names(indexation->where, names, is_nested);
+                collect_scope_names(indexation->index, names, is_nested);
+            }
+            break;
+        case NODE_ARRAY:
+            {
+                for (AstNode* element: static_cast<ArrayNode*>(node)->elements) collect_scope_names(element, names, is_nested);
+            }
+            break;
+        case NODE_OBJECT:
+            {
+                // field names are keys, not variables
+                for (AstNode* field: static_cast<ObjectNode*>(node)->fields)
+                {
+                    BinaryOperationNode* assignment = node_cast<BinaryOperationNode>(field);
+
+                    if (assignment && assignment->operator_token->type == ASSIGN) collect_scope_names(assignment->right_operand, names, is_nested);
+                    else collect_scope_names(field, names, is_nested);
+                }
+            }
+            break;
+        case NODE_CALL:
+            {
+                CallNode* call = static_cast<CallNode*>(node);
+
+                collect_scope_names(call->to_call, names, is_nested);
+                for (AstNode* argument: call->with_args) collect_scope_names(argument, names, is_nested);
+            }
+            break;
+        case NODE_IF:
+            {
+                IfNode* if_statement = static_cast<IfNode*>(node);
+
+                collect_scope_names(if_statement->condition, names, is_nested);
+                collect_scope_names(if_statement->success_block, names, is_nested);
+                collect_scope_names(if_statement->fail_block, names, is_nested);
+            }
+            break;
+        case NODE_WHILE:
+            {
+                WhileNode* while_node = static_cast<WhileNode*>(node);
+
+                collect_scope_names(while_node->condition, names, is_nested);
+                collect_scope_names(while_node->block, names, is_nested);
+            }
+            break;
+        case NODE_BLOCK:
+            {
+                BlockNode* block = static_cast<BlockNode*>(node);
+
+                // a lazy body stays unparsed until its first call, it gets its own slots then
+                if (block->deferred_by)
+                {
+                    names.is_capturing_all = true;
+                    break;
+                }
+
+                for (AstNode* node: block->nodes) collect_scope_names(node, names, is_nested);
+            }
+            break;
+        case NODE_FUNCTION:
+            {
+                FunctionNode* function = static_cast<FunctionNode*>(node);
+
+                (is_nested ? names.captured : names.declared).insert(string(function->id->token->value));
+
+                collect_scope_names(function->block, names, true);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Parameters and locals get frame slots, except names that nested functions use,
+// names of `fn` declarations (they record the memory they are defined in) and
+// locals that may already exist in an enclosing scope, whose writes propagate there.
+void CompilerMain::compile_function(FunctionNode* function, const set<string>& enclosing_names, Function* target, Inliner* inliner, ConstantPool* constants, RecordTypes* records)
+{
+    BlockNode* body = function->block;
+
+    if (body->deferred_by) body->deferred_by->parse_deferred(body);
+
+    ScopeNames names;
+    collect_scope_names(body, names, false);
+
+    Scope scope;
+    scope.memory_names = enclosing_names;
+    scope.is_collected = true;
+    scope.can_reuse_frame = names.declared.empty();
+
+    auto is_memory_name = [&names](const string& name) {
+        return names.is_capturing_all || names.captured.count(name) || names.declared.count(name);
+    };
+
+    target->args_ids.clear();
+    target->args_slots.clear();
+
+    map<string, Type*> parameter_types;
+
+    for (IdentifierNode* argument: function->needed_arguments)
+    {
+        string name(argument->token->value);
+
+        target->args_ids.push_back(name);
+
+        // annotations are not checked on call, so nothing is known about the value passed in
+        parameter_types[name] = nullptr;
+        if (argument->type) scope.declared_types[name] = annotation_to_type(argument->type);
+
+        if (is_memory_name(name))
+        {
+            target->args_slots.push_back(-1);
+            scope.memory_names.insert(name);
+        } else
+        {
+            if (!scope.slots.count(name)) scope.slots[name] = scope.add_slot();
+            target->args_slots.push_back(scope.slots[name]);
+        }
+    }
+
+    for (const string& name: names.written)
+    {
+        if (scope.slots.count(name)) continue;
+
+        if (is_memory_name(name) || enclosing_names.count(name)) scope.memory_names.insert(name);
+        else scope.slots[name] = scope.add_slot();
+    }
+
+    scope.memory_names.insert(names.declared.begin(), names.declared.end());
+
+    CompilerMain compiler(&scope, inliner, constants, records);
+
+    // arguments are bound before the body runs
+    compiler.assigned_locals.insert(target->args_ids.begin(), target->args_ids.end());
+
+    compiler.infer_local_types(body, parameter_types);
+    compiler.node_to_bytecode(body);
+
+    target->bytecode = compiler.get_generated_bytecode();
+    target->locals_count = scope.locals_count;
+}
+
+void CompilerMain::emit_read(const string& name)
+{
+    auto inlined = this->inlined_arguments.find(name);
+
+    if (inlined != this->inlined_arguments.end())
+    {
+        if (inlined->second.constant) this->node_to_bytecode(inlined->second.constant);
+        else this->generated.push_back(Instruction(Opcode(OP_LOAD_LOCAL), inlined->second.slot));
+
+        return;
+    }
+
+    auto slot = this->scope->slots.find(name);
+
+    if (slot != this->scope->slots.end()) this->generated.push_back(Instruction(Opcode(OP_LOAD_LOCAL), slot->second));
+    else this->emit_name(OP_READ_DATA, name);
+}
+
+void CompilerMain::emit_write(const string& name)
+{
+    auto slot = this->scope->slots.find(name);
+
+    if (slot != this->scope->slots.end()) this->generated.push_back(Instruction(Opcode(OP_STORE_LOCAL), slot->second));
+    else this->emit_name(OP_WRITE_DATA, name);
+}
+
+// Expressions of the parameters alone: literals, operators, indexation, array and
+// object literals and calls to functions that are inlined themselves
+bool is_inlinable_expression(AstNode* node, const set<string>& parameters, const Inliner& inliner, int& size)
+{
+    size++;
+
+    switch (node->kind)
+    {
+        case NODE_IDENTIFIER:
+            return parameters.count(string(static_cast<IdentifierNode*>(node)->token->value)) > 0;
+        case NODE_LITERAL:
+            return true;
+        case NODE_BINARY_OPERATION:
+            {
+                if (static_cast<BinaryOperationNode*>(node)->operator_token->type == ASSIGN) return false;
+            }
+            break;
+        case NODE_CALL:
+            {
+                CallNode* call = static_cast<CallNode*>(node);
+                IdentifierNode* callee = node_cast<IdentifierNode>(call->to_call);
+
+                if (!callee) return false;
+
+                auto candidate = inliner.candidates.find(string(callee->token->value));
+                if (candidate == inliner.candidates.end() || candidate->second->needed_arguments.size() != call->with_args.size()) return false;
+
+                for (AstNode* argument: call->with_args)
+                {
+                    if (!is_inlinable_expression(argument, parameters, inliner, size)) return false;
+                }
+
+                return true;
+            }
+        case NODE_PARENTHISIZED:
+        case NODE_INDEXATION:
+        case NODE_ARRAY:
+        case NODE_OBJECT:
+            break;
+        default:
+            return false;
+    }
+
+    bool is_inlinable = true;
+
+    visit_children(node, [&](AstNode* child) {
+        if (is_inlinable) is_inlinable = is_inlinable_expression(child, parameters, inliner, size);
+    });
+
+    return is_inlinable;
+}
+
+// A name is inlined only when a single top-level `fn` declares it and it is never
+// assigned, never a parameter and never read other than to call it, so every call
+// through it reaches that declaration. Calls inside an inlined body must be inlinable
+// too, which also rules out recursion.
+void CompilerMain::find_inline_candidates(BlockNode* program)
+{
+    map<string, int> declarations;
+    set<string> rebound;
+    set<string> escaping;
+
+    function<void(AstNode*)> scan = [&](AstNode* node) {
+        switch (node->kind)
+        {
+            case NODE_IDENTIFIER:
+                {
+                    escaping.insert(string(static_cast<IdentifierNode*>(node)->token->value));
+                }
+                break;
+            case NODE_BINARY_OPERATION:
+                {
+                    BinaryOperationNode* binary = static_cast<BinaryOperationNode*>(node);
+                    IdentifierNode* identifier = node_cast<IdentifierNode>(binary->left_operand);
+
+                    if (identifier && binary->operator_token->type == ASSIGN) rebound.insert(string(identifier->token->value));
+                }
+                break;
+            case NODE_CALL:
+                {
+                    CallNode* call = static_cast<CallNode*>(node);
+
+                    if (!node_cast<IdentifierNode>(call->to_call)) scan(call->to_call);
+                    for (AstNode* argument: call->with_args) scan(argument);
+                }
+                return;
+            case NODE_BLOCK:
+                {
+                    BlockNode* block = static_cast<BlockNode*>(node);
+
+                    // a lazy body is left unparsed, any name it mentions may escape there
+                    if (block->deferred_by)
+                    {
+                        for (string_view identifier: block->deferred_by->deferred_identifiers(block)) escaping.insert(string(identifier));
+                    }
+                }
+                break;
+            case NODE_FUNCTION:
+                {
+                    FunctionNode* function = static_cast<FunctionNode*>(node);
+
+                    declarations[string(function->id->token->value)]++;
+                    for (IdentifierNode* argument: function->needed_arguments) rebound.insert(string(argument->token->value));
+                }
+                break;
+            default:
+                break;
+        }
+
+        visit_children(node, scan);
+    };
+
+    scan(program);
+
+    int statements_count = program->nodes.size();
+
+    for (int i = 0; i < statements_count; i++)
+    {
+        FunctionNode* function = node_cast<FunctionNode>(program->nodes[i]);
+        if (!function) continue;
+
+        string name(function->id->token->value);
+        if (declarations[name] != 1 || rebound.count(name) || escaping.count(name)) continue;
+
+        // a lazily parsed body is never looked at, so it is not inlined either
+        BlockNode* body = function->block;
+        if (body->deferred_by) continue;
+
+        UnaryOperationNode* returned = body->nodes.size() == 1 ? node_cast<UnaryOperationNode>(body->nodes[0]) : nullptr;
+
+        if (!returned || returned->token->type != RETURN) continue;
+
+        set<string> parameters;
+        for (IdentifierNode* argument: function->needed_arguments) parameters.insert(string(argument->token->value));
+
+        if (parameters.size() != function->needed_arguments.size()) continue;
+
+        int size = 0;
+
+        if (is_inlinable_expression(returned->operand, parameters, *this->inliner, size) && size <= this->inliner->threshold)
+        {
+            this->inliner->candidates[name] = function;
+            this->inliner->definitions[name] = i;
+        }
+    }
+}
+
+// Compiles the returned expression of an inline candidate in place of the call.
+// Arguments are evaluated once, in order, into fresh slots of the caller; literal
+// arguments are used directly so the body can still be folded.
+bool CompilerMain::inline_call(CallNode* call)
+{
+    IdentifierNode* callee = node_cast<IdentifierNode>(call->to_call);
+    if (!callee) return false;
+
+    string name(callee->token->value);
+
+    auto candidate = this->inliner->candidates.find(name);
+    if (candidate == this->inliner->candidates.end()) return false;
+
+    FunctionNode* function = candidate->second;
+
+    // before its definition has run the call has to fail as it always did
+    if (this->inliner->definitions[name] >= this->inliner->current_statement) return false;
+    if (function->needed_arguments.size() != call->with_args.size()) return false;
+
+    vector<Type*> argument_types;
+
+    for (AstNode* argument: call->with_args) argument_types.push_back(this->get_node_type(argument));
+
+    map<string, InlinedArgument> arguments;
+
+    int arguments_count = call->with_args.size();
+
+    for (int i = 0; i < arguments_count; i++)
+    {
+        AstNode* argument = call->with_args[i];
+        InlinedArgument inlined = { -1, argument_types[i], node_cast<LiteralNode>(argument) };
+
+        // a parameter of the body around this call is passed along as it is
+        IdentifierNode* identifier = node_cast<IdentifierNode>(argument);
+        auto outer = identifier ? this->inlined_arguments.find(string(identifier->token->value)) : this->inlined_arguments.end();
+
+        if (outer != this->inlined_arguments.end()) inlined = outer->second;
+        else if (!inlined.constant)
+        {
+            this->node_to_bytecode(argument);
+
+            inlined.slot = this->scope->add_slot();
+            this->generated.push_back(Instruction(Opcode(OP_STORE_LOCAL), inlined.slot));
+        }
+
+        arguments[string(function->needed_arguments[i]->token->value)] = inlined;
+    }
+
+    swap(this->inlined_arguments, arguments);
+    this->node_to_bytecode(static_cast<UnaryOperationNode*>(function->block->nodes[0])->operand);
+    swap(this->inlined_arguments, arguments);
+
+    this->inliner->report.push_back("inlined call to " + name + " at position " + to_string(callee->token->position));
+
+    return true;
+}
+
+// Fields are laid out in the order the typedef declares them, so object literals
+// written in the same order need no reordering.
+void CompilerMain::find_record_types(BlockNode* program)
+{
+    for (AstNode* statement: program->nodes)
+    {
+        TypedefNode* typedef_node = node_cast<TypedefNode>(statement);
+        ObjectNode* object = typedef_node ? node_cast<ObjectNode>(typedef_node->type) : nullptr;
+
+        if (!object) continue;
+
+        Type* type = annotation_to_type(object);
+        if (!type) continue;
+
+        string name(typedef_node->id->token->value);
+
+        // a type redefined later has no single layout
+        if (this->records->types.count(name))
+        {
+            this->records->layouts.erase(name);
+            continue;
+        }
+
+        RecordLayout* layout = new RecordLayout();
+        layout->type_name = name;
+
+        for (AstNode* field: object->fields)
+        {
+            string field_name(static_cast<IdentifierNode*>(static_cast<BinaryOperationNode*>(field)->left_operand)->token->value);
+
+            if (layout->slots.count(field_name)) continue;
+
+            layout->slots[field_name] = layout->fields.size();
+            layout->fields.push_back(static_cast<String*>(this->constants->constants[this->constants->intern_string(field_name)]));
+        }
+
+        layout->constant_index = this->constants->add(layout);
+
+        this->records->types[name] = static_cast<ObjectType*>(type);
+
+        // getfield and setfield could not address it, so its objects stay plain ones
+        if (int(layout->fields.size()) > MAX_RECORD_FIELDS || layout->constant_index > MAX_FIELD_LAYOUT_INDEX) continue;
+
+        this->records->layouts[name] = layout;
+    }
+}
+
+RecordLayout* CompilerMain::get_record_layout(Type* type)
+{
+    if (!type || type->kind != TYPE_LITERAL) return nullptr;
+
+    auto layout = this->records->layouts.find(static_cast<LiteralType*>(type)->value);
+
+    return layout != this->records->layouts.end() ? layout->second : nullptr;
+}
+
+RecordLayout* CompilerMain::get_record_layout(AstNode* node)
+{
+    switch (node->kind)
+    {
+        case NODE_PARENTHISIZED:
+            return this->get_record_layout(static_cast<ParenthisizedNode*>(node)->wrapped);
+        case NODE_IDENTIFIER:
+            {
+                string name(static_cast<IdentifierNode*>(node)->token->value);
+
+                auto inlined = this->inlined_arguments.find(name);
+                if (inlined != this->inlined_arguments.end()) return this->get_record_layout(inlined->second.type);
+
+                auto declared = this->scope->declared_types.find(name);
+                if (declared != this->scope->declared_types.end()) return this->get_record_layout(declared->second);
+            }
+            break;
+        case NODE_INDEXATION:
+            {
+                IndexationNode* indexation = static_cast<IndexationNode*>(node);
+
+                RecordLayout* layout = this->get_record_layout(indexation->where);
+                int slot = this->get_field_slot(layout, indexation->index);
+
+                if (slot >= 0) return this->get_record_layout(this->records->types[layout->type_name]->fields[layout->fields[slot]->data]);
+            }
+            break;
+        default:
+            break;
+    }
+
+    return nullptr;
+}
+
+int CompilerMain::get_field_slot(RecordLayout* layout, AstNode* index)
+{
+    LiteralNode* literal = node_cast<LiteralNode>(index);
+    if (!layout || !literal || literal->token->type != STRING) return -1;
+
+    auto slot = layout->slots.find(string(literal->token->value));
+
+    return slot != layout->slots.end() ? slot->second : -1;
+}
+
+// An object literal with exactly the fields of the layout. Its values are computed
+// in source order; when that is not the slot order they wait in fresh slots.
+bool CompilerMain::emit_record(RecordLayout* layout, AstNode* value)
+{
+    ObjectNode* object = node_cast<ObjectNode>(value);
+    if (!layout || !object || object->fields.size() != layout->fields.size()) return false;
+
+    vector<int> field_slots;
+
+    for (AstNode* field: object->fields)
+    {
+        BinaryOperationNode* assignment = node_cast<BinaryOperationNode>(field);
+        IdentifierNode* name = assignment && assignment->operator_token->type == ASSIGN ? node_cast<IdentifierNode>(assignment->left_operand) : nullptr;
+
+        if (!name) return false;
+
+        auto slot = layout->slots.find(string(name->token->value));
+        if (slot == layout->slots.end() || find(field_slots.begin(), field_slots.end(), slot->second) != field_slots.end()) return false;
+
+        field_slots.push_back(slot->second);
+    }
+
+    bool is_in_order = is_sorted(field_slots.begin(), field_slots.end());
+
+    vector<int> temporaries(field_slots.size());
+
+    int fields_count = object->fields.size();
+
+    for (int i = 0; i < fields_count; i++)
+    {
+        this->node_to_bytecode(static_cast<BinaryOperationNode*>(object->fields[i])->right_operand);
+
+        if (!is_in_order)
+        {
+            temporaries[field_slots[i]] = this->scope->add_slot();
+            this->generated.push_back(Instruction(OP_STORE_LOCAL, temporaries[field_slots[i]]));
+        }
+    }
+
+    if (!is_in_order)
+    {
+        for (int temporary: temporaries) this->generated.push_back(Instruction(OP_LOAD_LOCAL, temporary));
+    }
+
+    this->generated.push_back(Instruction(OP_MAKE_RECORD, layout->constant_index));
+
+    return true;
 }
 
-bool CompilerMain::is_types_compatible(AstNode* node_1, AstNode* node_2)
+void collect_loop_effects(AstNode* node, LoopEffects& effects, const Inliner& inliner)
 {
+    switch (node->kind)
+    {
+        case NODE_FUNCTION:
+            {
+                // the body does not run here, only the declaration
+                effects.written.insert(string(static_cast<FunctionNode*>(node)->id->token->value));
+            }
+            return;
+        case NODE_BINARY_OPERATION:
+            {
+                BinaryOperationNode* binary = static_cast<BinaryOperationNode*>(node);
 
+                if (binary->operator_token->type == ASSIGN)
+                {
+                    if (IdentifierNode* identifier = node_cast<IdentifierNode>(binary->left_operand)) effects.written.insert(string(identifier->token->value));
+                    else effects.has_index_write = true;
+                }
+            }
+            break;
+        case NODE_CALL:
+            {
+                // inline candidates neither assign nor call anything else
+                IdentifierNode* callee = node_cast<IdentifierNode>(static_cast<CallNode*>(node)->to_call);
+
+                if (!callee || !inliner.candidates.count(string(callee->token->value))) effects.has_call = true;
+            }
+            break;
+        default:
+            break;
+    }
+
+    visit_children(node, [&](AstNode* child) { collect_loop_effects(child, effects, inliner); });
 }
 
-Type* CompilerMain::get_node_type(AstNode* node)
+bool CompilerMain::is_loop_invariant(AstNode* node, const LoopEffects& effects)
 {
+    switch (node->kind)
+    {
+        case NODE_LITERAL:
+            return true;
+        case NODE_IDENTIFIER:
+            {
+                string name(static_cast<IdentifierNode*>(node)->token->value);
+
+                if (effects.written.count(name)) return false;
+
+                // slot locals are written by this scope alone, names in memory also by the functions it calls
+                return this->scope->slots.count(name) || !effects.has_call;
+            }
+        case NODE_PARENTHISIZED:
+            return this->is_loop_invariant(static_cast<ParenthisizedNode*>(node)->wrapped, effects);
+        case NODE_BINARY_OPERATION:
+            {
+                BinaryOperationNode* binary = static_cast<BinaryOperationNode*>(node);
+
+                if (binary->operator_token->type == ASSIGN) return false;
 
+                return this->is_loop_invariant(binary->left_operand, effects) && this->is_loop_invariant(binary->right_operand, effects);
+            }
+        case NODE_INDEXATION:
+            {
+                IndexationNode* indexation = static_cast<IndexationNode*>(node);
+
+                if (effects.has_index_write || effects.has_call) return false;
+
+                return this->is_loop_invariant(indexation->where, effects) && this->is_loop_invariant(indexation->index, effects);
+            }
+        default:
+            return false;
+    }
 }
 
-void CompilerMain::node_to_bytecode(AstNode* node)
+// Arithmetic and comparisons of statically typed numbers, which cannot stop the VM
+bool CompilerMain::is_non_faulting(AstNode* node)
 {
-    if (IdentifierNode* identifier = dynamic_cast<IdentifierNode*>(node))
-    {
-        this->generated.push_back(
-            Instruction(Opcode(OP_READ_DATA), new String(identifier->token->value))
-        );
-    } else if (LiteralNode* literal = dynamic_cast<LiteralNode*>(node)) 
+    switch (node->kind)
     {
-        Object* data;
+        case NODE_LITERAL:
+            return true;
+        case NODE_IDENTIFIER:
+            {
+                string name(static_cast<IdentifierNode*>(node)->token->value);
 
-        TokenType token_type = literal->token->type;
-        string token_value = literal->token->value;
+                // a slot local fails to load until it is assigned
+                return this->get_node_type(node) && (this->inlined_arguments.count(name) || this->assigned_locals.count(name));
+            }
+        case NODE_PARENTHISIZED:
+            return this->is_non_faulting(static_cast<ParenthisizedNode*>(node)->wrapped);
+        case NODE_BINARY_OPERATION:
+            {
+                BinaryOperationNode* binary = static_cast<BinaryOperationNode*>(node);
 
-        switch (token_type)
-        {
-            case DIGIT:
-                {
-                    bool integer = true;
-                    if (token_value.find(".") != string::npos) integer = false;
+                Type* left_type = this->get_node_type(binary->left_operand);
+                Type* right_type = this->get_node_type(binary->right_operand);
 
-                    if (!integer) data = new Double(stod(token_value));
-                    else data = new Integer(stoi(token_value));
-                }
-                break;   
-            case TRUE:
-                {
-                    data = new Boolean(true);
-                }
-                break;
-            case FALSE:
-                {
-                    data = new Boolean(false);
-                }
-                break;
-            case NIL:
-                {
-                    data = new Null();
-                }
-                break;
-            case STRING:
+                bool is_int = is_named_type(left_type, "int") && is_named_type(right_type, "int");
+                bool is_double = is_named_type(left_type, "double") && is_named_type(right_type, "double");
+
+                switch (binary->operator_token->type)
                 {
-                    data = new String(token_value);
+                    case PLUS:
+                    case MINUS:
+                    case ASTERISK:
+                    case BIGGER:
+                    case SMALLER:
+                    case BIGGER_OR_EQ:
+                    case SMALLER_OR_EQ:
+                        break;
+                    case SLASH:
+                        {
+                            // integer division by zero stops the VM
+                            is_int = false;
+                        }
+                        break;
+                    default:
+                        return false;
                 }
-                break;
-            default:
-                break;
-        }
 
-        this->generated.push_back(Instruction(Opcode(OP_PUSHV), data));
-    } else if (CallNode* call = dynamic_cast<CallNode*>(node)) 
-    {
-        for (AstNode* argument: call->with_args)
-        {   
-            this->node_to_bytecode(argument);
-        }
+                return (is_int || is_double) && this->is_non_faulting(binary->left_operand) && this->is_non_faulting(binary->right_operand);
+            }
+        default:
+            return false;
+    }
+}
 
-        this->node_to_bytecode(call->to_call);
+// Largest invariant operations and index reads of a loop, in the order their code runs.
+// Expressions that cannot fail are always taken. The condition runs at least once, so
+// one that can fail is taken from it as well while is_order_kept says that nothing run
+// before it in the condition can fail or call; the body may not run some parts, so its
+// search starts with is_order_kept false.
+void CompilerMain::find_loop_invariants(AstNode* node, const LoopEffects& effects, bool& is_order_kept, vector<AstNode*>& invariants)
+{
+    if (node->kind == NODE_FUNCTION) return;
 
-        this->generated.push_back(Instruction(OP_CALL));
-    } else if (FunctionNode* function = dynamic_cast<FunctionNode*>(node))
-    {
-        CompilerMain compiler;
-        compiler.node_to_bytecode(function->block);
+    bool is_computation = node->kind == NODE_INDEXATION;
 
-        Function function_object(compiler.get_generated_bytecode(), function->needed_arguments.size());
+    if (BinaryOperationNode* binary = node_cast<BinaryOperationNode>(node))
+    {
+        if (binary->operator_token->type == ASSIGN)
+        {
+            this->find_loop_invariants(binary->right_operand, effects, is_order_kept, invariants);
+            return;
+        }
 
-        for (IdentifierNode* argument: function->needed_arguments) function_object.args_ids.push_back(argument->token->value);
+        is_computation = true;
+    }
 
-        this->generated.push_back(Instruction(Opcode(OP_PUSHV), new Function(function_object)));
-        this->generated.push_back(Instruction(Opcode(OP_WRITE_DATA), new String(function->id->token->value)));
-    } else if (UnaryOperationNode* unary = dynamic_cast<UnaryOperationNode*>(node))
+    if (is_computation && this->is_loop_invariant(node, effects) && (is_order_kept || this->is_non_faulting(node)))
     {
-        TokenType token_type = unary->token->type;
+        invariants.push_back(node);
+        return;
+    }
 
-        this->node_to_bytecode(unary->operand);
+    auto find_in = [&](AstNode* child) { this->find_loop_invariants(child, effects, is_order_kept, invariants); };
 
-        switch (token_type)
-            {
-            case PRINT:
-                {
-                    this->generated.push_back(Instruction(OP_PRINT));
-                }
-                break;
-            case WAIT:
-                {
-                    this->generated.push_back(Instruction(OP_WAIT));
-                }
-                break;
-            case RETURN:
-                {
-                    this->generated.push_back(Instruction(OP_RETURN));
-                }
-                break;
-            default:
-                break;
-        }
-    } else if (ParenthisizedNode* parenthisized = dynamic_cast<ParenthisizedNode*>(node))
+    // index reads push the index first, calls their arguments
+    if (IndexationNode* indexation = node_cast<IndexationNode>(node))
     {
-        this->node_to_bytecode(parenthisized->wrapped);
-    } else if (IfNode* if_statement = dynamic_cast<IfNode*>(node))
+        find_in(indexation->index);
+        find_in(indexation->where);
+    } else if (CallNode* call = node_cast<CallNode>(node))
     {
-        this->node_to_bytecode(if_statement->condition);
+        for (AstNode* argument: call->with_args) find_in(argument);
+        find_in(call->to_call);
+    } else visit_children(node, find_in);
 
-        CompilerMain compiler1;
-        compiler1.node_to_bytecode(if_statement->success_block);
+    if (!this->is_non_faulting(node)) is_order_kept = false;
+}
 
-        CompilerMain compiler2;
-        compiler2.node_to_bytecode(if_statement->fail_block);
+void CompilerMain::hoist(const vector<AstNode*>& invariants)
+{
+    for (AstNode* invariant: invariants)
+    {
+        int begin = this->generated.size();
 
-        Bytecode success_bytecode = compiler1.get_generated_bytecode();
-        Bytecode fail_bytecode = compiler2.get_generated_bytecode();
+        this->node_to_bytecode(invariant);
 
-        if (!fail_bytecode.empty())
+        // constant expressions are folded into one push already
+        if (this->generated.size() - begin == 1 && this->generated.back().opcode == OP_PUSHV)
         {
-            success_bytecode.push_back(Instruction(Opcode(OP_JUMP), new Integer(fail_bytecode.size())));
+            this->generated.resize(begin);
+            continue;
         }
 
-        this->generated.push_back(Instruction(Opcode(OP_JUMPIFNOT), new Integer(success_bytecode.size())));
+        int slot = this->scope->add_slot();
 
-        for (Instruction instr: success_bytecode)
-        {
-            this->generated.push_back(instr);
-        }
+        this->generated.push_back(Instruction(Opcode(OP_STORE_LOCAL), slot));
+        this->hoisted[invariant] = slot;
+    }
+}
 
-        for (Instruction instr: fail_bytecode)
-        {
-            this->generated.push_back(instr);
-        }
-    } else if (WhileNode* while_node = dynamic_cast<WhileNode*>(node))
-    {
-        int old = this->generated.size();
+// `i := i + 1` and `i := i - 1` on an integer local become a single instruction
+bool CompilerMain::emit_counter_step(const string& name, AstNode* value)
+{
+    auto slot = this->scope->slots.find(name);
+    auto local_type = this->scope->local_types.find(name);
 
-        this->node_to_bytecode(while_node->condition);
+    if (slot == this->scope->slots.end() || local_type == this->scope->local_types.end() || !is_named_type(local_type->second, "int")) return false;
 
-        int added = this->generated.size() - old;
+    BinaryOperationNode* binary = node_cast<BinaryOperationNode>(value);
+    if (!binary) return false;
 
-        CompilerMain compiler1;
-        compiler1.node_to_bytecode(while_node->block);
+    TokenType operator_type = binary->operator_token->type;
 
-        Bytecode bytecode = compiler1.get_generated_bytecode();
-        bytecode.push_back(Instruction(Opcode(OP_JUMP), new Integer(-bytecode.size() + -5)));
+    auto is_counter = [&name](AstNode* operand) {
+        IdentifierNode* identifier = node_cast<IdentifierNode>(operand);
+        return identifier && identifier->token->value == name;
+    };
 
-        this->generated.push_back(Instruction(Opcode(OP_JUMPIFNOT), new Integer(bytecode.size())));
+    auto is_one = [](AstNode* operand) {
+        LiteralNode* literal = node_cast<LiteralNode>(operand);
+        return literal && literal->token->type == DIGIT && literal->token->is_integer && literal->token->integer_value == 1;
+    };
 
-        for (Instruction instr: bytecode)
-        {
-            this->generated.push_back(instr);
-        }
-    } else if (ArrayNode* array = dynamic_cast<ArrayNode*>(node))
+    bool is_increment = operator_type == PLUS && ((is_counter(binary->left_operand) && is_one(binary->right_operand)) || (is_one(binary->left_operand) && is_counter(binary->right_operand)));
+    bool is_decrement = operator_type == MINUS && is_counter(binary->left_operand) && is_one(binary->right_operand);
+
+    if (!is_increment && !is_decrement) return false;
+
+    this->generated.push_back(Instruction(is_increment ? OP_INC_LOCAL : OP_DEC_LOCAL, slot->second));
+
+    return true;
+}
+
+// `return f(...)` replaces the frame of the function with one for f rather than
+// nesting a new one, so recursion through tail calls runs in constant stack
+bool CompilerMain::emit_tail_call(AstNode* returned)
+{
+    CallNode* call = node_cast<CallNode>(returned);
+    if (!call || !this->scope->can_reuse_frame) return false;
+
+    if (this->inline_call(call))
     {
-        this->temp_array_index++;
+        this->generated.push_back(Instruction(OP_RETURN));
+        return true;
+    }
 
-        string temp_array_address = "tempnewarray" + to_string(this->temp_array_index);
+    for (AstNode* argument: call->with_args) this->node_to_bytecode(argument);
 
-        this->generated.push_back(Instruction(Opcode(OP_NEWARRAY)));
-        this->generated.push_back(Instruction(Opcode(OP_WRITE_DATA), new String(temp_array_address)));
+    this->node_to_bytecode(call->to_call);
 
-        int index = 0;
-        for (AstNode* element: array->elements)
-        {
-            this->generated.push_back(Instruction(Opcode(OP_PUSHV), new Integer(index)));
+    this->generated.push_back(Instruction(OP_TAILCALL, call->with_args.size()));
 
-            this->node_to_bytecode(element);
+    return true;
+}
 
-            this->generated.push_back(Instruction(Opcode(OP_READ_DATA), new String(temp_array_address)));
-            this->generated.push_back(Instruction(Opcode(OP_SETINDEX)));
+// Replaces `pushv a, pushv b, <binary op>` at the end of the generated code with
+// `pushv result`. Nested constant operands are already folded by then, so whole
+// literal expressions collapse into one push.
+void CompilerMain::fold_binary(int operands_begin)
+{
+    if (this->generated.size() - operands_begin != 3) return;
 
-            index++;
-        }
+    Instruction left = this->generated[operands_begin];
+    Instruction right = this->generated[operands_begin + 1];
+    Instruction operation = this->generated[operands_begin + 2];
 
-        this->generated.push_back(Instruction(Opcode(OP_READ_DATA), new String(temp_array_address)));
+    if (left.opcode != OP_PUSHV || right.opcode != OP_PUSHV) return;
 
-        this->generated.push_back(Instruction(Opcode(OP_PUSHV), new Null()));
-        this->generated.push_back(Instruction(Opcode(OP_WRITE_DATA), new String(temp_array_address)));
-    } else if (ObjectNode* object = dynamic_cast<ObjectNode*>(node))
-    {
-        this->temp_object_index++;
+    // operands the VM cannot combine are left for it to report at runtime
+    Object* result = evaluate_binary(operation.opcode, this->constants->constants[left.operand], this->constants->constants[right.operand]);
+    if (!result) return;
 
-        string temp_object_address = "tempnewobject" + to_string(this->temp_object_index);
+    this->generated.resize(operands_begin);
+    this->emit_constant(OP_PUSHV, result);
+}
 
-        this->generated.push_back(Instruction(Opcode(OP_NEWOBJECT)));
-        this->generated.push_back(Instruction(Opcode(OP_WRITE_DATA), new String(temp_object_address)));
+void CompilerMain::node_to_bytecode(AstNode* node)
+{
+    auto hoisted = this->hoisted.find(node);
 
-        for (AstNode* field: object->fields)
-        {
-            if (BinaryOperationNode* assignment = dynamic_cast<BinaryOperationNode*>(field))
+    if (hoisted != this->hoisted.end())
+    {
+        this->generated.push_back(Instruction(Opcode(OP_LOAD_LOCAL), hoisted->second));
+        return;
+    }
+
+    switch (node->kind)
+    {
+        case NODE_IDENTIFIER:
+            {
+                IdentifierNode* identifier = static_cast<IdentifierNode*>(node);
+
+                this->emit_read(string(identifier->token->value));
+            }
+            break;
+        case NODE_LITERAL:
             {
-                if (assignment->operator_token->type == ASSIGN)
+                LiteralNode* literal = static_cast<LiteralNode*>(node);
+
+                Object* data;
+
+                TokenType token_type = literal->token->type;
+                string_view token_value = literal->token->value;
+
+                switch (token_type)
                 {
-                    IdentifierNode* identifier = dynamic_cast<IdentifierNode*>(assignment->left_operand);
-                    if (!identifier) throw runtime_error("Compilation error! Assignment left operand can be only identifier");
+                    case DIGIT:
+                        {
+                            if (!literal->token->is_integer) data = new Double(literal->token->double_value);
+                            else data = new Integer(literal->token->integer_value);
+                        }
+                        break;   
+                    case TRUE:
+                        {
+                            data = new Boolean(true);
+                        }
+                        break;
+                    case FALSE:
+                        {
+                            data = new Boolean(false);
+                        }
+                        break;
+                    case NIL:
+                        {
+                            data = new Null();
+                        }
+                        break;
+                    case STRING:
+                        {
+                            data = new String(string(token_value));
+                        }
+                        break;
+                    default:
+                        break;
+                }
 
-                    this->generated.push_back(Instruction(Opcode(OP_PUSHV), new String(identifier->token->value)));
+                this->emit_constant(OP_PUSHV, data);
+            }
+            break;
+        case NODE_CALL:
+            {
+                CallNode* call = static_cast<CallNode*>(node);
 
-                    this->node_to_bytecode(assignment->right_operand);
+                if (this->inline_call(call)) break;
 
-                    this->generated.push_back(Instruction(Opcode(OP_READ_DATA), new String(temp_object_address)));
-                    this->generated.push_back(Instruction(Opcode(OP_SETINDEX)));
+                for (AstNode* argument: call->with_args)
+                {   
+                    this->node_to_bytecode(argument);
                 }
+
+                this->node_to_bytecode(call->to_call);
+
+                // the VM takes as many arguments as the function has, the count is for later passes
+                this->generated.push_back(Instruction(OP_CALL, call->with_args.size()));
             }
-        }
+            break;
+        case NODE_FUNCTION:
+            {
+                FunctionNode* function = static_cast<FunctionNode*>(node);
 
-        this->generated.push_back(Instruction(Opcode(OP_READ_DATA), new String(temp_object_address)));
+                Function function_object({}, function->needed_arguments.size());
 
-        this->generated.push_back(Instruction(Opcode(OP_PUSHV), new Null()));
-        this->generated.push_back(Instruction(Opcode(OP_WRITE_DATA), new String(temp_object_address)));
-    } else if (IndexationNode* indexation = dynamic_cast<IndexationNode*>(node))
-    {
-        this->node_to_bytecode(indexation->index);
-        this->node_to_bytecode(indexation->where);
+                for (IdentifierNode* argument: function->needed_arguments) function_object.args_ids.push_back(string(argument->token->value));
 
-        this->generated.push_back(Instruction(Opcode(OP_READINDEX)));
-    } else if (BinaryOperationNode* binary = dynamic_cast<BinaryOperationNode*>(node))
-    {
-        TokenType operator_type = binary->operator_token->type;
-        AstNode* left_operand = binary->left_operand;
-        if (IdentifierNode* identifier = dynamic_cast<IdentifierNode*>(left_operand))
-        {
-            if (operator_type == ASSIGN)
+                if (function->block->deferred_by)
+                {
+                    // the body is still unparsed, so parsing and compiling it waits for the first call
+                    function_object.compile_body = [function, enclosing_names = this->scope->memory_names, inliner = this->inliner, constants = this->constants, records = this->records, statement = this->inliner->current_statement](Function* target) {
+                        inliner->current_statement = statement;
+                        compile_function(function, enclosing_names, target, inliner, constants, records);
+                    };
+                } else compile_function(function, this->scope->memory_names, &function_object, this->inliner, this->constants, this->records);
+
+                this->emit_constant(OP_PUSHV, new Function(function_object));
+                this->emit_name(OP_WRITE_DATA, string(function->id->token->value));
+            }
+            break;
+        case NODE_UNARY_OPERATION:
             {
-                this->node_to_bytecode(binary->right_operand);
-                this->generated.push_back(Instruction(Opcode(OP_WRITE_DATA), new String(identifier->token->value))); 
-                
-                return;
-            };
-        } else if (IndexationNode* indexation = dynamic_cast<IndexationNode*>(left_operand))
-        {
-            if (operator_type == ASSIGN)
+                UnaryOperationNode* unary = static_cast<UnaryOperationNode*>(node);
+
+                TokenType token_type = unary->token->type;
+
+                if (token_type == RETURN && this->emit_tail_call(unary->operand)) break;
+
+                this->node_to_bytecode(unary->operand);
+
+                switch (token_type)
+                    {
+                    case PRINT:
+                        {
+                            this->generated.push_back(Instruction(OP_PRINT));
+                        }
+                        break;
+                    case WAIT:
+                        {
+                            this->generated.push_back(Instruction(OP_WAIT));
+                        }
+                        break;
+                    case RETURN:
+                        {
+                            this->generated.push_back(Instruction(OP_RETURN));
+                        }
+                        break;
+                    default:
+                        break;
+                }
+            }
+            break;
+        case NODE_PARENTHISIZED:
             {
-                this->node_to_bytecode(indexation->index);
-                this->node_to_bytecode(binary->right_operand);
-                this->node_to_bytecode(indexation->where);
+                ParenthisizedNode* parenthisized = static_cast<ParenthisizedNode*>(node);
 
-                this->generated.push_back(Instruction(Opcode(OP_SETINDEX))); 
-                
-                return;
-            };
-        }
+                this->node_to_bytecode(parenthisized->wrapped);
+            }
+            break;
+        case NODE_IF:
+            {
+                IfNode* if_statement = static_cast<IfNode*>(node);
 
-        this->node_to_bytecode(binary->left_operand);
-        this->node_to_bytecode(binary->right_operand);
+                this->node_to_bytecode(if_statement->condition);
 
-        switch (binary->operator_token->type)
-        {
-            case PLUS:
+                int to_fail = this->emit_condition_jump(if_statement->condition);
+
+                set<string> assigned_before = this->assigned_locals;
+
+                this->node_to_bytecode(if_statement->success_block);
+
+                if (!if_statement->fail_block->nodes.empty())
                 {
-                    this->generated.push_back(Instruction(Opcode(OP_ADD)));
-                }
-                break;
-            case MINUS:
+                    int to_end = this->emit_jump(OP_JUMP);
+
+                    set<string> assigned_on_success = move(this->assigned_locals);
+                    this->assigned_locals = move(assigned_before);
+
+                    this->bind_jump(to_fail);
+                    this->node_to_bytecode(if_statement->fail_block);
+                    this->bind_jump(to_end);
+
+                    // after the if only what both branches assign
+                    for (auto name = this->assigned_locals.begin(); name != this->assigned_locals.end();)
+                    {
+                        if (assigned_on_success.count(*name)) name++;
+                        else name = this->assigned_locals.erase(name);
+                    }
+                } else
                 {
-                    this->generated.push_back(Instruction(Opcode(OP_SUB)));
+                    this->bind_jump(to_fail);
+                    this->assigned_locals = move(assigned_before);
                 }
-                break;
-            case ASTERISK:
+            }
+            break;
+        case NODE_WHILE:
+            {
+                WhileNode* while_node = static_cast<WhileNode*>(node);
+
+                LoopEffects effects;
+
+                collect_loop_effects(while_node->condition, effects, *this->inliner);
+                collect_loop_effects(while_node->block, effects, *this->inliner);
+
+                vector<AstNode*> condition_invariants;
+                vector<AstNode*> body_invariants;
+
+                if (this->inliner->is_hoisting)
                 {
-                    this->generated.push_back(Instruction(Opcode(OP_MUL)));
+                    bool is_condition_order_kept = true;
+                    bool is_body_order_kept = false;
+
+                    this->find_loop_invariants(while_node->condition, effects, is_condition_order_kept, condition_invariants);
+                    this->find_loop_invariants(while_node->block, effects, is_body_order_kept, body_invariants);
                 }
-                break;
-            case SLASH:
+
+                // the body may not run, so what it assigns is not known to be assigned after the loop
+                set<string> assigned_before = this->assigned_locals;
+
+                this->hoist(condition_invariants);
+
+                if (body_invariants.empty())
                 {
-                    this->generated.push_back(Instruction(Opcode(OP_DIV)));
-                }
-                break;
-            case EQ:
+                    int loop_start = this->generated.size();
+
+                    this->node_to_bytecode(while_node->condition);
+
+                    int to_end = this->emit_condition_jump(while_node->condition);
+
+                    this->node_to_bytecode(while_node->block);
+
+                    this->emit_jump_to(OP_JUMP, loop_start);
+                    this->bind_jump(to_end);
+                } else
                 {
-                    this->generated.push_back(Instruction(Opcode(OP_EQ)));
+                    // the condition is checked once before the body invariants are computed,
+                    // so they are only computed when the loop is entered
+                    this->node_to_bytecode(while_node->condition);
+
+                    int to_end = this->emit_condition_jump(while_node->condition);
+
+                    this->hoist(body_invariants);
+
+                    int body_start = this->generated.size();
+
+                    this->node_to_bytecode(while_node->block);
+                    this->node_to_bytecode(while_node->condition);
+
+                    int to_exit = this->emit_condition_jump(while_node->condition);
+
+                    this->emit_jump_to(OP_JUMP, body_start);
+                    this->bind_jump(to_end);
+                    this->bind_jump(to_exit);
                 }
-                break;
-            case NOTEQ:
+
+                for (AstNode* invariant: condition_invariants) this->hoisted.erase(invariant);
+                for (AstNode* invariant: body_invariants) this->hoisted.erase(invariant);
+
+                this->assigned_locals = move(assigned_before);
+            }
+            break;
+        case NODE_ARRAY:
+            {
+                ArrayNode* array = static_cast<ArrayNode*>(node);
+
+                for (AstNode* element: array->elements) this->node_to_bytecode(element);
+
+                this->generated.push_back(Instruction(Opcode(OP_MAKE_ARRAY), array->elements.size()));
+            }
+            break;
+        case NODE_OBJECT:
+            {
+                ObjectNode* object = static_cast<ObjectNode*>(node);
+
+                int fields_count = 0;
+
+                for (AstNode* field: object->fields)
                 {
-                    this->generated.push_back(Instruction(Opcode(OP_NOTEQ)));
+                    if (BinaryOperationNode* assignment = node_cast<BinaryOperationNode>(field))
+                    {
+                        if (assignment->operator_token->type == ASSIGN)
+                        {
+                            IdentifierNode* identifier = node_cast<IdentifierNode>(assignment->left_operand);
+                            if (!identifier) throw runtime_error("Compilation error! Assignment left operand can be only identifier");
+
+                            this->emit_name(OP_PUSHV, string(identifier->token->value));
+
+                            this->node_to_bytecode(assignment->right_operand);
+
+                            fields_count++;
+                        }
+                    }
                 }
-                break;
-            case AND:
+
+                this->generated.push_back(Instruction(Opcode(OP_MAKE_OBJECT), fields_count));
+            }
+            break;
+        case NODE_INDEXATION:
+            {
+                IndexationNode* indexation = static_cast<IndexationNode*>(node);
+
+                RecordLayout* layout = this->get_record_layout(indexation->where);
+                int slot = this->get_field_slot(layout, indexation->index);
+
+                if (slot >= 0)
                 {
-                    this->generated.push_back(Instruction(Opcode(OP_AND)));
+                    this->node_to_bytecode(indexation->where);
+                    this->generated.push_back(Instruction(OP_GETFIELD, field_operand(layout->constant_index, slot)));
+
+                    break;
                 }
-                break;
-            case OR:
+
+                this->node_to_bytecode(indexation->index);
+                this->node_to_bytecode(indexation->where);
+
+                this->generated.push_back(Instruction(Opcode(OP_READINDEX)));
+            }
+            break;
+        case NODE_BINARY_OPERATION:
+            {
+                BinaryOperationNode* binary = static_cast<BinaryOperationNode*>(node);
+
+                TokenType operator_type = binary->operator_token->type;
+                AstNode* left_operand = binary->left_operand;
+                if (IdentifierNode* identifier = node_cast<IdentifierNode>(left_operand))
                 {
-                    this->generated.push_back(Instruction(Opcode(OP_OR)));
-                }
-                break;
-            case BIGGER:
+                    if (operator_type == ASSIGN)
+                    {
+                        string name(identifier->token->value);
+
+                        if (identifier->type) this->scope->declared_types[name] = annotation_to_type(identifier->type);
+
+                        this->assigned_locals.insert(name);
+
+                        if (this->emit_counter_step(name, binary->right_operand)) return;
+
+                        if (!this->emit_record(this->get_record_layout(identifier), binary->right_operand)) this->node_to_bytecode(binary->right_operand);
+                        this->emit_write(name);
+
+                        return;
+                    };
+                } else if (IndexationNode* indexation = node_cast<IndexationNode>(left_operand))
                 {
-                    this->generated.push_back(Instruction(Opcode(OP_BIGGER)));
+                    if (operator_type == ASSIGN)
+                    {
+                        RecordLayout* layout = this->get_record_layout(indexation->where);
+                        int slot = this->get_field_slot(layout, indexation->index);
+
+                        if (slot >= 0)
+                        {
+                            this->node_to_bytecode(binary->right_operand);
+                            this->node_to_bytecode(indexation->where);
+
+                            this->generated.push_back(Instruction(OP_SETFIELD, field_operand(layout->constant_index, slot)));
+
+                            return;
+                        }
+
+                        this->node_to_bytecode(indexation->index);
+                        this->node_to_bytecode(binary->right_operand);
+                        this->node_to_bytecode(indexation->where);
+
+                        this->generated.push_back(Instruction(Opcode(OP_SETINDEX))); 
+
+                        return;
+                    };
                 }
-                break;
-            case SMALLER:
+
+                int operands_begin = this->generated.size();
+
+                this->node_to_bytecode(binary->left_operand);
+                this->node_to_bytecode(binary->right_operand);
+
+                switch (binary->operator_token->type)
                 {
-                    this->generated.push_back(Instruction(Opcode(OP_SMALLER)));
+                    case PLUS:
+                        {
+                            this->generated.push_back(Instruction(Opcode(OP_ADD)));
+                        }
+                        break;
+                    case MINUS:
+                        {
+                            this->generated.push_back(Instruction(Opcode(OP_SUB)));
+                        }
+                        break;
+                    case ASTERISK:
+                        {
+                            this->generated.push_back(Instruction(Opcode(OP_MUL)));
+                        }
+                        break;
+                    case SLASH:
+                        {
+                            this->generated.push_back(Instruction(Opcode(OP_DIV)));
+                        }
+                        break;
+                    case EQ:
+                        {
+                            this->generated.push_back(Instruction(Opcode(OP_EQ)));
+                        }
+                        break;
+                    case NOTEQ:
+                        {
+                            this->generated.push_back(Instruction(Opcode(OP_NOTEQ)));
+                        }
+                        break;
+                    case AND:
+                        {
+                            this->generated.push_back(Instruction(Opcode(OP_AND)));
+                        }
+                        break;
+                    case OR:
+                        {
+                            this->generated.push_back(Instruction(Opcode(OP_OR)));
+                        }
+                        break;
+                    case BIGGER:
+                        {
+                            this->generated.push_back(Instruction(Opcode(OP_BIGGER)));
+                        }
+                        break;
+                    case SMALLER:
+                        {
+                            this->generated.push_back(Instruction(Opcode(OP_SMALLER)));
+                        }
+                        break;
+                    case BIGGER_OR_EQ:
+                        {
+                            this->generated.push_back(Instruction(Opcode(OP_BIGGEROREQ)));
+                        }
+                        break;
+                    case SMALLER_OR_EQ:
+                        {
+                            this->generated.push_back(Instruction(Opcode(OP_SMALLEROREQ)));
+                        }
+                        break;
+                    default:
+                        break;
                 }
-                break;
-            case BIGGER_OR_EQ:
+
+                this->fold_binary(operands_begin);
+
+                if (this->generated.size() - operands_begin > 1) this->specialize_binary(binary);
+            }
+            break;
+        case NODE_BLOCK:
+            {
+                BlockNode* block = static_cast<BlockNode*>(node);
+
+                if (block->deferred_by) block->deferred_by->parse_deferred(block);
+
+                // the first block of a top-level compiler is the program, whose names live in memory
+                bool is_program = !this->scope->is_collected;
+
+                if (is_program)
                 {
-                    this->generated.push_back(Instruction(Opcode(OP_BIGGEROREQ)));
+                    ScopeNames names;
+                    collect_scope_names(block, names, false);
+
+                    this->scope->memory_names.insert(names.written.begin(), names.written.end());
+                    this->scope->memory_names.insert(names.declared.begin(), names.declared.end());
+                    this->scope->is_collected = true;
+
+                    if (this->inliner->threshold > 0) this->find_inline_candidates(block);
+                    this->find_record_types(block);
                 }
-                break;
-            case SMALLER_OR_EQ:
+
+                int statements_count = block->nodes.size();
+
+                for (int i = 0; i < statements_count; i++)
                 {
-                    this->generated.push_back(Instruction(Opcode(OP_SMALLEROREQ)));
+                    if (is_program) this->inliner->current_statement = i;
+
+                    this->node_to_bytecode(block->nodes[i]);
                 }
-                break;
-            default:
-                break;
-        }
-    } else if (BlockNode* block = dynamic_cast<BlockNode*>(node))
-    {
-        for (AstNode* node: block->nodes) this->node_to_bytecode(node);
+            }
+            break;
+        default:
+            break;
     }
 }
\ No newline at end of file
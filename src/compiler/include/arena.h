@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Bump allocator for one compilation. Nothing is freed individually: every block
+// goes away together with the arena, and destructors of the objects are never run,
+// so only types whose own memory also comes from the arena should live here.
+class Arena
+{
+    private:
+        vector<unique_ptr<char[]>> blocks;
+
+        char* current = nullptr;
+        size_t left = 0;
+
+        size_t next_block_size = 64 * 1024;
+    public:
+        void* allocate(size_t size, size_t alignment)
+        {
+            size_t padding = (alignment - reinterpret_cast<uintptr_t>(this->current) % alignment) % alignment;
+
+            if (!this->current || padding + size > this->left)
+            {
+                size_t block_size = max(this->next_block_size, size + alignment);
+
+                this->blocks.emplace_back(new char[block_size]);
+                this->current = this->blocks.back().get();
+                this->left = block_size;
+
+                if (this->next_block_size < 16 * 1024 * 1024) this->next_block_size *= 2;
+
+                padding = (alignment - reinterpret_cast<uintptr_t>(this->current) % alignment) % alignment;
+            }
+
+            void* allocated = this->current + padding;
+
+            this->current += padding + size;
+            this->left -= padding + size;
+
+            return allocated;
+        }
+
+        template <typename T, typename... Args>
+        T* make(Args&&... args)
+        {
+            return new (this->allocate(sizeof(T), alignof(T))) T(forward<Args>(args)...);
+        }
+
+        Arena() = default;
+
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+};
+
+template <typename T>
+struct ArenaAllocator
+{
+    using value_type = T;
+
+    Arena* arena;
+
+    ArenaAllocator(Arena* arena) { this->arena = arena; };
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) { this->arena = other.arena; };
+
+    T* allocate(size_t count) { return static_cast<T*>(this->arena->allocate(count * sizeof(T), alignof(T))); }
+    // memory goes back only when the whole arena is freed
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return this->arena == other.arena; }
+
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return this->arena != other.arena; }
+};
+
+template <typename T>
+using ArenaVector = vector<T, ArenaAllocator<T>>;
@@ -2,20 +2,35 @@
 
 #include <vector>
 #include <string>
+#include <map>
+#include <set>
+#include <memory>
 
 #include "parser.h"
 #include "../../include/vm.h"
 
 using namespace std;
 
+enum TypeKind
+{
+    TYPE_LITERAL,
+    TYPE_POINTER,
+    TYPE_OBJECT,
+    TYPE_FUNCTION,
+    TYPE_ARRAY,
+};
+
 struct Type {
-    bool is_optional;
+    TypeKind kind;
+    bool is_optional = false;
+
+    Type(TypeKind kind) { this->kind = kind; };
 };
 
 struct LiteralType : Type
 {
     string value;
-    LiteralType(string value)
+    LiteralType(string value) : Type(TYPE_LITERAL)
     {
         this->value = value;
     }
@@ -24,7 +39,7 @@ struct LiteralType : Type
 struct PointerType : Type
 {
     Type* value;
-    PointerType(Type* value)
+    PointerType(Type* value) : Type(TYPE_POINTER)
     {
         this->value = value;
     }
@@ -33,7 +48,7 @@ struct PointerType : Type
 struct ObjectType : Type
 {
     map<string, Type*> fields;
-    ObjectType(map<string, Type*> fields)
+    ObjectType(map<string, Type*> fields) : Type(TYPE_OBJECT)
     {
         this->fields = fields;
     }
@@ -44,7 +59,7 @@ struct FunctionType : Type
     Type* returns;
     vector<Type*> args;
 
-    FunctionType(Type* returns, vector<Type*> args)
+    FunctionType(Type* returns, vector<Type*> args) : Type(TYPE_FUNCTION)
     {
         this->returns = returns;
         this->args = args;
@@ -54,23 +69,177 @@ struct FunctionType : Type
 struct ArrayType : Type
 {
     Type* can_store;
-    ArrayType(Type* can_store)
+    ArrayType(Type* can_store) : Type(TYPE_ARRAY)
     {
         this->can_store = can_store;
     }
 };
 
+bool is_same_type(Type* type_1, Type* type_2);
+bool is_named_type(Type* type, const string& name);
+
+// Variables of a function body (or of the top level) kept in numbered frame slots
+// rather than looked up by name in Memory.
+struct Scope
+{
+    map<string, int> slots;
+    int locals_count = 0;
+
+    // names that can be in Memory while this scope runs: the ones written here
+    // or in an enclosing scope, so a write to them has to go through Memory
+    set<string> memory_names;
+    bool is_collected = false;
+
+    // static types of slot locals, nullptr where it is not known; while they are
+    // being inferred a missing entry means no assignment has been seen yet
+    map<string, Type*> local_types;
+    map<string, Type*> declared_types;
+    bool is_inferring = false;
+
+    // a function body that declares no functions: nothing can refer to the memory
+    // of its frame, so its tail calls may reuse the frame
+    bool can_reuse_frame = false;
+
+    int add_slot() { return this->locals_count++; }
+};
+
+// Functions whose calls are replaced by their body: top-level `fn`s that only
+// return one small expression of their parameters. They are found once for the
+// whole program and shared by the compilers of every function body.
+struct Inliner
+{
+    // largest body, in expression nodes, that is still inlined; 0 turns inlining off
+    int threshold = 16;
+
+    // loop invariants are computed before their loop, off at -O0 like inlining
+    bool is_hoisting = true;
+
+    map<string, FunctionNode*> candidates;
+    // index of the top-level statement defining each candidate
+    map<string, int> definitions;
+
+    // top-level statement being compiled, calls before a definition are left alone
+    int current_statement = 0;
+
+    // one line per inlined call site
+    vector<string> report;
+};
+
+// Object types named by top-level typedefs, each laid out as a record. Found once
+// for the whole program and shared like the inliner.
+struct RecordTypes
+{
+    map<string, ObjectType*> types;
+    map<string, RecordLayout*> layouts;
+};
+
+// parameter of an inlined body: a literal argument itself, or the caller slot
+// the argument was stored in
+struct InlinedArgument
+{
+    int slot;
+    Type* type;
+    AstNode* constant;
+};
+
+// What can change while a while loop runs
+struct LoopEffects
+{
+    set<string> written;
+
+    // calls that are not inlined may write any name in memory and any array
+    bool has_call = false;
+    bool has_index_write = false;
+};
+
 class CompilerMain
 {
     private:
-        vector<Instruction> generated;
+        Bytecode generated;
+
+        Scope* scope;
+        unique_ptr<Scope> top_level_scope;
+
+        Inliner* inliner;
+        unique_ptr<Inliner> top_level_inliner;
+
+        ConstantPool* constants;
+        unique_ptr<ConstantPool> top_level_constants;
+
+        RecordTypes* records;
+        unique_ptr<RecordTypes> top_level_records;
+
+        // parameters of the body being inlined, they shadow everything else
+        map<string, InlinedArgument> inlined_arguments;
+
+        // loop invariant expressions already computed into a slot before the loop
+        map<AstNode*, int> hoisted;
+
+        // slot locals assigned on every path to the code being compiled, so loading
+        // them cannot fail
+        set<string> assigned_locals;
+
+        static void compile_function(FunctionNode* function, const set<string>& enclosing_names, Function* target, Inliner* inliner, ConstantPool* constants, RecordTypes* records);
+
+        void find_inline_candidates(BlockNode* program);
+        bool inline_call(CallNode* call);
+
+        void find_record_types(BlockNode* program);
 
-        int temp_array_index = 0;
-        int temp_object_index = 0;
+        // layout of the typedef'd type a value statically has, nullptr when there is none
+        RecordLayout* get_record_layout(AstNode* node);
+        RecordLayout* get_record_layout(Type* type);
+        // slot of a field indexed by a string literal, -1 when it is not one of the layout
+        int get_field_slot(RecordLayout* layout, AstNode* index);
 
+        bool emit_record(RecordLayout* layout, AstNode* value);
+
+        // pushes the instruction with its data interned in the constant pool
+        void emit_constant(Opcode opcode, Object* data);
+        void emit_name(Opcode opcode, const string& name);
+
+        void emit_read(const string& name);
+        void emit_write(const string& name);
+
+        // forward jump whose target is bound later, returns its index for bind_jump
+        int emit_jump(Opcode opcode);
+        void bind_jump(int jump);
+
+        void emit_jump_to(Opcode opcode, int target);
+        int emit_condition_jump(AstNode* condition);
+
+        // both are conservative: nullptr when the type is not known statically,
+        // and only types known to differ are incompatible
         bool is_types_compatible(AstNode* node_1, AstNode* node_2);
         Type* get_node_type(AstNode* node);
+
+        Type* get_binary_type(BinaryOperationNode* binary);
+        void infer_local_types(BlockNode* body, const map<string, Type*>& parameter_types);
+
+        bool is_loop_invariant(AstNode* node, const LoopEffects& effects);
+        bool is_non_faulting(AstNode* node);
+        void find_loop_invariants(AstNode* node, const LoopEffects& effects, bool& is_order_kept, vector<AstNode*>& invariants);
+        void hoist(const vector<AstNode*>& invariants);
+
+        bool emit_counter_step(const string& name, AstNode* value);
+        bool emit_tail_call(AstNode* returned);
+
+        void fold_binary(int operands_begin);
+        void specialize_binary(BinaryOperationNode* binary);
     public:
         void node_to_bytecode(AstNode* node);
-        vector<Instruction> get_generated_bytecode();
+        // moves the code out of the compiler
+        Bytecode get_generated_bytecode();
+
+        // size of the frame the generated code needs
+        int get_locals_count();
+
+        void set_inline_threshold(int threshold);
+        // level 0 leaves loops as written
+        void set_optimization_level(int level);
+        const vector<string>& get_inlined_calls();
+
+        const ConstantPool& get_constant_pool();
+
+        CompilerMain(Scope* scope = nullptr, Inliner* inliner = nullptr, ConstantPool* constants = nullptr, RecordTypes* records = nullptr);
 };
\ No newline at end of file
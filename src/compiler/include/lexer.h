@@ -1,6 +1,9 @@
 #pragma once
 
+#include <cstdint>
+#include <initializer_list>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 #include <regex>
@@ -69,29 +72,94 @@ enum TokenType
     NEWLINE,
 
     WAIT,
+
+    TOKEN_TYPES_COUNT,
 };  
 
+static_assert(TOKEN_TYPES_COUNT <= 64, "TokenSet keeps one bit per token type in a 64-bit word");
+
+// Set of token types as a bitmask, cheap to build at compile time and to test
+struct TokenSet
+{
+    uint64_t bits = 0;
+
+    constexpr TokenSet(initializer_list<TokenType> types)
+    {
+        for (TokenType type: types) this->bits |= uint64_t(1) << type;
+    }
+
+    constexpr bool contains(TokenType type) const { return (this->bits >> type) & 1; }
+};
+
+// value is a view into the source buffer given to Lexer, which must outlive the tokens
 struct Token 
 {
     TokenType type;
-    string value;
+    string_view value;
     int position;
 
-    Token(TokenType type, string value, int position) { this->position = position; this->value = value; this->type = type; };
+    // filled for DIGIT tokens, so later stages never reparse the text
+    bool is_integer = false;
+    int integer_value = 0;
+    double double_value = 0;
+
+    Token(TokenType type, string_view value, int position) { this->position = position; this->value = value; this->type = type; };
+
+    Token() = default;
+
+    // index just past the token in the source, quotes of a STRING included
+    int end() const { return this->position + this->value.size() + (this->type == STRING ? 2 : 0); }
 };
 
 class Lexer 
 {
     private:
-        vector<Token*> tokens;
-        string code;
+        vector<Token> tokens;
+        string_view code;
         bool trace;
         int position;
 
-        Token* next_token();
+        Token next_token();
+        Token make_token(TokenType type, int start_position, int length);
+
+        void lex_until(int end);
+        void trace_tokens();
+        vector<int> find_chunk_boundaries(int chunks_count);
     public:
 
-        Lexer(string code, bool trace);
+        Lexer(string_view code, bool trace);
+
+        vector<Token> make_tokens();
+
+        // Same tokens as make_tokens(), lexed on up to threads_count threads. The code is
+        // cut into chunks at newlines outside string literals, so no token spans two chunks.
+        vector<Token> make_tokens_parallel(unsigned int threads_count);
+
+        // Tokens for this lexer's code, which was produced from the source of `previous`
+        // by replacing removed_length bytes at edit_position with inserted_length new ones.
+        // Only the damaged region is lexed again; tokens after it are shifted and reused.
+        vector<Token> relex(const vector<Token>& previous, int edit_position, int removed_length, int inserted_length);
+
+        // Lexes the token after the previous one into `token`, false at the end of the code
+        bool pull(Token& token);
+};
+
+// Pulls tokens from a Lexer on demand and keeps only the last TOKEN_LOOKAHEAD of them,
+// so memory does not grow with the token count. A pointer it returns is valid until
+// TOKEN_LOOKAHEAD more tokens are pulled.
+class TokenStream
+{
+    private:
+        static const int TOKEN_LOOKAHEAD = 4;
+
+        Token window[TOKEN_LOOKAHEAD];
+
+        Lexer* lexer;
+        int lexed;
+        bool is_finished;
+    public:
+        // nullptr at the end of the code
+        Token* at(int index);
 
-        vector<Token*> make_tokens();
+        TokenStream(Lexer* lexer);
 };
\ No newline at end of file
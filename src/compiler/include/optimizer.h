@@ -0,0 +1,24 @@
+#pragma once
+
+#include "../../include/vm.h"
+
+using namespace std;
+
+struct OptimizerReport
+{
+    int instructions_before = 0;
+    int instructions_after = 0;
+};
+
+bool is_jump(Opcode opcode);
+
+// index of the instruction the jump at index goes to
+int jump_target(const Bytecode& bytecode, int index);
+
+// Peephole passes over compiled code, also applied to the functions it defines
+// (lazily compiled ones when their body is compiled). Level 0 leaves the code as
+// is, level 1 threads jumps, drops jumps to the next instruction and turns a store
+// followed by a load of the same variable into dup + store, level 2 also removes
+// stores of constants to locals that are never read afterwards. The functions are
+// found in constants, the pool the code was compiled with.
+void optimize_bytecode(Bytecode& bytecode, const ConstantPool& constants, int level, OptimizerReport& report);
@@ -1,21 +1,57 @@
 #pragma once
 
 #include <iostream>
+#include <memory>
 #include <vector>
 
 #include "lexer.h"
+#include "arena.h"
 
 using namespace std;
 
+enum NodeKind
+{
+    NODE_UNKNOWN,
+
+    NODE_PARENTHISIZED,
+    NODE_IDENTIFIER,
+    NODE_BINARY_OPERATION,
+    NODE_UNARY_OPERATION,
+    NODE_INDEXATION,
+    NODE_ARRAY,
+    NODE_OBJECT,
+    NODE_LITERAL,
+    NODE_BLOCK,
+    NODE_IF,
+    NODE_WHILE,
+    NODE_FUNCTION,
+    NODE_TYPEDEF,
+    NODE_CALL,
+};
+
 struct AstNode
 {
+    NodeKind kind;
+
+    AstNode(NodeKind kind = NODE_UNKNOWN) { this->kind = kind; };
+
     virtual string tostring() { return "unknown node"; }
 };
 
+// Downcast checked by the kind tag, so walking the AST needs no RTTI
+template <typename T>
+T* node_cast(AstNode* node)
+{
+    if (node && node->kind == T::node_kind) return static_cast<T*>(node);
+    return nullptr;
+}
+
 struct ParenthisizedNode : AstNode
 {
+    static const NodeKind node_kind = NODE_PARENTHISIZED;
+
     AstNode* wrapped;
-    ParenthisizedNode(AstNode* wrapped) { this->wrapped = wrapped; };
+    ParenthisizedNode(AstNode* wrapped) : AstNode(node_kind) { this->wrapped = wrapped; };
 
     string tostring() override
     {
@@ -25,50 +61,58 @@ struct ParenthisizedNode : AstNode
 
 struct IdentifierNode : AstNode
 {
+    static const NodeKind node_kind = NODE_IDENTIFIER;
+
     Token* token;
     AstNode* type;
 
-    IdentifierNode(Token* token, AstNode* type = nullptr) { this->token = token; this->type = type; };
+    IdentifierNode(Token* token, AstNode* type = nullptr) : AstNode(node_kind) { this->token = token; this->type = type; };
 
     string tostring() override
     {
-        return "[id: " + this->token->value + ", type: " + (this->type ? this->type->tostring() : "unknown") + "]";
+        return "[id: " + string(this->token->value) + ", type: " + (this->type ? this->type->tostring() : "unknown") + "]";
     }
 };
 
 struct BinaryOperationNode : AstNode
 {
+    static const NodeKind node_kind = NODE_BINARY_OPERATION;
+
     AstNode* left_operand;
     AstNode* right_operand;
     Token* operator_token;
 
-    BinaryOperationNode(AstNode* left_operand, Token* operator_token, AstNode* right_operand) { this->operator_token = operator_token; this->left_operand = left_operand; this->right_operand = right_operand; };
+    BinaryOperationNode(AstNode* left_operand, Token* operator_token, AstNode* right_operand) : AstNode(node_kind) { this->operator_token = operator_token; this->left_operand = left_operand; this->right_operand = right_operand; };
 
     string tostring() override
     {
-        return "[binary: " + this->left_operand->tostring() + " " + this->operator_token->value + " " + this->right_operand->tostring() + "]";
+        return "[binary: " + this->left_operand->tostring() + " " + string(this->operator_token->value) + " " + this->right_operand->tostring() + "]";
     }
 };
 
 struct UnaryOperationNode : AstNode
 {
+    static const NodeKind node_kind = NODE_UNARY_OPERATION;
+
     Token* token;
     AstNode* operand;
 
-    UnaryOperationNode(Token* token, AstNode* operand) { this->token = token; this->operand = operand; };
+    UnaryOperationNode(Token* token, AstNode* operand) : AstNode(node_kind) { this->token = token; this->operand = operand; };
 
     string tostring() override
     {
-        return "unary: " + this->token->value + ", operand: " + this->operand->tostring();
+        return "unary: " + string(this->token->value) + ", operand: " + this->operand->tostring();
     }
 };
 
 struct IndexationNode : AstNode
 {
+    static const NodeKind node_kind = NODE_INDEXATION;
+
     AstNode* where;
     AstNode* index;
 
-    IndexationNode(AstNode* where, AstNode* index) { this->where = where; this->index = index; };
+    IndexationNode(AstNode* where, AstNode* index) : AstNode(node_kind) { this->where = where; this->index = index; };
 
     string tostring() override
     {
@@ -78,9 +122,11 @@ struct IndexationNode : AstNode
 
 struct ArrayNode : AstNode
 {
-    vector<AstNode*> elements;
+    static const NodeKind node_kind = NODE_ARRAY;
 
-    ArrayNode(vector<AstNode*> elements) { this->elements = elements; };
+    ArenaVector<AstNode*> elements;
+
+    ArrayNode(ArenaVector<AstNode*> elements) : AstNode(node_kind), elements(move(elements)) {};
 
     string tostring() override
     {
@@ -97,9 +143,11 @@ struct ArrayNode : AstNode
 
 struct ObjectNode : AstNode
 {
-    vector<AstNode*> fields;
+    static const NodeKind node_kind = NODE_OBJECT;
+
+    ArenaVector<AstNode*> fields;
 
-    ObjectNode(vector<AstNode*> fields) { this->fields = fields; };
+    ObjectNode(ArenaVector<AstNode*> fields) : AstNode(node_kind), fields(move(fields)) {};
 
     string tostring() override
     {
@@ -116,20 +164,32 @@ struct ObjectNode : AstNode
 
 struct LiteralNode : AstNode
 {
+    static const NodeKind node_kind = NODE_LITERAL;
+
     Token* token;
 
-    LiteralNode(Token* token) { this->token = token; };
+    LiteralNode(Token* token) : AstNode(node_kind) { this->token = token; };
 
     string tostring() override
     {
-        return "[literal: " + this->token->value + "]";
+        return "[literal: " + string(this->token->value) + "]";
     }
 };
 
+class Parser;
+
 struct BlockNode : AstNode
 {
-    vector<AstNode*> nodes;
-    BlockNode(vector<AstNode*> nodes) { this->nodes = nodes; };
+    static const NodeKind node_kind = NODE_BLOCK;
+
+    ArenaVector<AstNode*> nodes;
+
+    // Set for a pre-parsed function body: nodes stays empty until
+    // deferred_by->parse_deferred() parses tokens [deferred_begin, deferred_end).
+    Parser* deferred_by = nullptr;
+    int deferred_begin = 0;
+    int deferred_end = 0;
+    BlockNode(ArenaVector<AstNode*> nodes) : AstNode(node_kind), nodes(move(nodes)) {};
 
     string tostring() override
     {
@@ -139,6 +199,8 @@ struct BlockNode : AstNode
 
 struct IfNode : AstNode
 {
+    static const NodeKind node_kind = NODE_IF;
+
     BlockNode* success_block;
     BlockNode* fail_block;
     AstNode* condition;
@@ -148,15 +210,17 @@ struct IfNode : AstNode
         return "if " + this->condition->tostring();
     }
 
-    IfNode(BlockNode* success_block, BlockNode* fail_block, AstNode* condition) { this->success_block = success_block; this->fail_block = fail_block; this->condition = condition; };
+    IfNode(BlockNode* success_block, BlockNode* fail_block, AstNode* condition) : AstNode(node_kind) { this->success_block = success_block; this->fail_block = fail_block; this->condition = condition; };
 };
 
 struct WhileNode : AstNode
 {
+    static const NodeKind node_kind = NODE_WHILE;
+
     AstNode* condition;
     BlockNode* block;
 
-    WhileNode(AstNode* condition, BlockNode* block) { this->condition = condition; this->block = block; };
+    WhileNode(AstNode* condition, BlockNode* block) : AstNode(node_kind) { this->condition = condition; this->block = block; };
 
     string tostring() override
     {
@@ -166,13 +230,15 @@ struct WhileNode : AstNode
 
 struct FunctionNode : AstNode
 {
+    static const NodeKind node_kind = NODE_FUNCTION;
+
     IdentifierNode* id;
     AstNode* return_type;
 
-    vector<IdentifierNode*> needed_arguments;
+    ArenaVector<IdentifierNode*> needed_arguments;
     BlockNode* block;
 
-    FunctionNode(IdentifierNode* id, vector<IdentifierNode*> needed_arguments, BlockNode* block, AstNode* return_type) { this->id = id; this->needed_arguments = needed_arguments, this->block = block; this->return_type = return_type; };
+    FunctionNode(IdentifierNode* id, ArenaVector<IdentifierNode*> needed_arguments, BlockNode* block, AstNode* return_type) : AstNode(node_kind), needed_arguments(move(needed_arguments)) { this->id = id; this->block = block; this->return_type = return_type; };
 
     string tostring() override
     {
@@ -183,16 +249,18 @@ struct FunctionNode : AstNode
             args_string += argument->tostring() + " ";
         };
 
-        return "function " + this->id->token->value + ", returns: " + this->return_type->tostring() + ", args: " + args_string;
+        return "function " + string(this->id->token->value) + ", returns: " + this->return_type->tostring() + ", args: " + args_string;
     }
 };
 
 struct TypedefNode : AstNode
 {
+    static const NodeKind node_kind = NODE_TYPEDEF;
+
     IdentifierNode* id;
     AstNode* type;
 
-    TypedefNode(IdentifierNode* id, AstNode* type)
+    TypedefNode(IdentifierNode* id, AstNode* type) : AstNode(node_kind)
     {
         this->id = id;
         this->type = type;
@@ -200,16 +268,18 @@ struct TypedefNode : AstNode
 
     string tostring() override
     {
-        return "typedefinition: " + this->id->token->value + " = " + this->type->tostring();
+        return "typedefinition: " + string(this->id->token->value) + " = " + this->type->tostring();
     }
 };
 
 struct CallNode : AstNode
 {
+    static const NodeKind node_kind = NODE_CALL;
+
     AstNode* to_call;
-    vector<AstNode*> with_args;
+    ArenaVector<AstNode*> with_args;
 
-    CallNode(AstNode* to_call, vector<AstNode*> with_args) { this->to_call = to_call; this->with_args = with_args; };
+    CallNode(AstNode* to_call, ArenaVector<AstNode*> with_args) : AstNode(node_kind), with_args(move(with_args)) { this->to_call = to_call; };
 
     string tostring() override
     {
@@ -232,15 +302,14 @@ class Parser
         CallNode* parse_call(AstNode* to_call);
         IndexationNode* parse_indexation(AstNode* where);
 
-        AstNode* parse_binary();
-        AstNode* term();
-        AstNode* subterm();
-        AstNode* headterm();
+        AstNode* parse_binary(AstNode* left, int min_precedence);
+        int binary_precedence_at(int position);
 
         UnaryOperationNode* parse_unary();
         WhileNode* parse_while();
         IfNode* parse_if();
         BlockNode* parse_block();
+        BlockNode* skip_block();
         IdentifierNode* parse_identifier();
         LiteralNode* parse_literal();
         ObjectNode* parse_object();
@@ -248,20 +317,63 @@ class Parser
         ParenthisizedNode* parse_parenthisized();
         TypedefNode* parse_typedef();
 
-        Token* eat(vector<TokenType> types);
-        bool match(vector<TokenType> types);
+        Token* eat(TokenSet types);
+        bool match(TokenSet types);
 
-        bool is_token(vector<TokenType> types, int position);
+        bool is_token(TokenSet types, int position);
 
-        AstNode* subparse(AstNode* node, int started_position, bool ignore_binaries = false);
+        AstNode* parse_primary();
+        AstNode* parse_postfix(AstNode* expression);
         AstNode* parse_expression(bool ignore_binaries = false);
 
         void parser_errorf(string text);
 
         int position;
+        bool lazy_functions;
+
+        // tokens are owned by the root parser; a worker parses [position, end) of them
+        vector<Token> tokens;
+
+        Parser* root;
+        int end;
+
+        // set when tokens are pulled from the lexer instead of read from `tokens`
+        unique_ptr<TokenStream> stream;
+
+        vector<unique_ptr<Parser>> workers;
 
-        vector<Token*> tokens;
+        Parser(Parser* root, int begin, int end);
+
+        Token* token_at(int position);
+        Token* retain(Token* token);
+
+        void parse_statements(BlockNode* block);
+        vector<int> find_statement_boundaries();
+
+        // owns every node of the AST, which lives exactly as long as the parser
+        Arena arena;
+
+        template <typename T>
+        ArenaVector<T> make_list() { return ArenaVector<T>(ArenaAllocator<T>(&this->arena)); }
     public:
         BlockNode* make_ast(bool trace);
-        Parser(vector<Token*> tokens);
+
+        // Same AST as make_ast, with top-level statements split at independent `fn`
+        // declarations and parsed on up to threads_count threads.
+        BlockNode* make_ast_parallel(bool trace, unsigned int threads_count);
+
+        // Parses a block left behind by skip_block, a no-op for blocks that are already parsed
+        void parse_deferred(BlockNode* block);
+
+        // Every identifier token of a block left behind by skip_block, without parsing it
+        vector<string_view> deferred_identifiers(BlockNode* block);
+
+        // With lazy_functions, function bodies are only brace-matched and parsed on
+        // first use, so the parser has to outlive everything compiled from the AST.
+        Parser(vector<Token> tokens, bool lazy_functions = false);
+
+        // Streaming parser: tokens are lexed as the parser reaches them, and only the ones
+        // the AST points to are copied into the arena. Function bodies are always parsed
+        // eagerly and make_ast_parallel falls back to make_ast, as both need all tokens.
+        Parser(Lexer* lexer);
 };
\ No newline at end of file
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <memory>
+
+#include "../../include/vm.h"
+
+using namespace std;
+
+struct RegisterReport
+{
+    int functions = 0;
+    int lowered_functions = 0;
+};
+
+// Lowers stack code whose frame has locals_count slots to register code, or returns
+// nullptr when it uses something the register VM does not run (tail calls, the old
+// array / object opcodes) or leaves values on the stack between statements.
+shared_ptr<RegisterCode> lower_to_registers(const Bytecode& bytecode, const ConstantPool& constants, int locals_count);
+
+// Lowers the functions defined in bytecode, lazily compiled ones once their body is
+// compiled. The ones that cannot be lowered keep running on the stack VM.
+void lower_functions(const Bytecode& bytecode, const ConstantPool& constants, RegisterReport& report);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string_view>
+
+using namespace std;
+
+enum ScannerKernel
+{
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2,
+};
+
+// Run scanners used by the lexer. Each returns the index of the first byte
+// at or after position that does not belong to the run (code.size() if the
+// run reaches the end). The kernel is picked once from the running CPU.
+size_t scan_whitespace(string_view code, size_t position);
+size_t scan_identifier(string_view code, size_t position);
+size_t scan_to_quote(string_view code, size_t position);
+
+ScannerKernel best_scanner_kernel();
+ScannerKernel get_scanner_kernel();
+void set_scanner_kernel(ScannerKernel kernel);
+
+const char* scanner_kernel_name(ScannerKernel kernel);
@@ -1,9 +1,16 @@
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cctype>
+#include <charconv>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <exception>
 
 #include "include/lexer.h"
+#include "include/scanner.h"
 
 using namespace std;
 
@@ -13,90 +20,367 @@ bool is_char_quote(char c)
     return false;
 }
 
-char* get_char_at_position(string code, int position)
+struct Keyword
 {
-    if (position < code.size()) return new char(code.at(position));
+    string_view text;
+    TokenType type;
+};
 
-    return nullptr;
+constexpr Keyword keywords[] = {
+    { "fn", FUNCTION },
+    { "return", RETURN },
+    { "print", PRINT },
+
+    { "if", IF },
+    { "else", ELSE },
+
+    { "while", WHILE },
+    { "for", FOR },
+
+    { "true", TRUE },
+    { "false", FALSE },
+
+    { "nil", NIL },
+
+    { "typedef", TYPE },
+
+    { "wait", WAIT },
+};
+
+constexpr size_t KEYWORD_TABLE_SIZE = 32;
+
+// first and last characters are enough to tell every keyword apart
+constexpr size_t keyword_hash(string_view word)
+{
+    return (size_t(word.front()) * 2 + size_t(word.back())) & (KEYWORD_TABLE_SIZE - 1);
 }
 
-Lexer::Lexer(string code, bool trace) 
+struct KeywordTable
+{
+    Keyword slots[KEYWORD_TABLE_SIZE];
+    bool has_collision;
+};
+
+constexpr KeywordTable make_keyword_table()
+{
+    KeywordTable table {};
+
+    for (const Keyword& keyword: keywords)
+    {
+        Keyword& slot = table.slots[keyword_hash(keyword.text)];
+        if (!slot.text.empty()) table.has_collision = true;
+
+        slot = keyword;
+    }
+
+    return table;
+}
+
+constexpr KeywordTable keyword_table = make_keyword_table();
+
+static_assert(!keyword_table.has_collision, "keyword_hash is no longer perfect for the keyword list");
+
+TokenType keyword_type(string_view word)
+{
+    const Keyword& slot = keyword_table.slots[keyword_hash(word)];
+
+    if (slot.text == word) return slot.type;
+    return IDENTIFIER;
+}
+
+Lexer::Lexer(string_view code, bool trace)
 {
     this->trace = trace;
     this->code = code;
     this->position = 0;
 }
 
-vector<Token*> Lexer::make_tokens() 
+void Lexer::lex_until(int end)
 {
-    while (this->position < this->code.size()) {
-        Token* token = this->next_token();
-        if (!token) break;
-        
-        this->tokens.push_back(token);
+    while (true) {
+        this->position = scan_whitespace(this->code.substr(0, end), this->position);
+        if (this->position >= end) break;
+
+        this->tokens.push_back(this->next_token());
         this->position++;
     }
+}
+
+void Lexer::trace_tokens()
+{
+    for (const Token& token: this->tokens) {
+        cout << token.type << " | " << token.value << endl;
+    }
+}
+
+vector<Token> Lexer::make_tokens()
+{
+    this->tokens.reserve(this->code.size() / 4 + 1);
+
+    this->lex_until(this->code.size());
+
+    if (this->trace) this->trace_tokens();
+
+    return move(this->tokens);
+}
+
+vector<int> Lexer::find_chunk_boundaries(int chunks_count)
+{
+    size_t size = this->code.size();
 
-    vector<Token*> filtered;
+    vector<int> boundaries = { 0 };
 
-    copy_if(this->tokens.begin(), this->tokens.end(), std::back_inserter(filtered), [](Token* token){ return token->type != WHITESPACE; } );
+    size_t next_quote = scan_to_quote(this->code, 0);
 
-    if (this->trace) {
-        for (Token* token_ptr: filtered) {
-            cout << token_ptr->type << " | " << token_ptr->value << endl;
+    for (int chunk = 1; chunk < chunks_count; chunk++)
+    {
+        size_t target = max(size * chunk / chunks_count, size_t(boundaries.back()));
+        size_t newline;
+
+        while (true)
+        {
+            newline = this->code.find('\n', target);
+            if (newline == string_view::npos) return boundaries;
+
+            // quotes always pair up into literals, so walking them tells if the newline is inside one
+            bool is_inside_string = false;
+
+            while (next_quote < newline)
+            {
+                size_t closing_quote = scan_to_quote(this->code, next_quote + 1);
+                if (closing_quote >= size) return boundaries;
+
+                next_quote = scan_to_quote(this->code, closing_quote + 1);
+
+                if (closing_quote > newline)
+                {
+                    is_inside_string = true;
+                    target = closing_quote + 1;
+                    break;
+                }
+            }
+
+            if (!is_inside_string) break;
         }
+
+        if (newline + 1 >= size) break;
+
+        boundaries.push_back(newline + 1);
     }
 
-    return filtered;
+    return boundaries;
 }
 
-Token* Lexer::next_token()
+vector<Token> Lexer::make_tokens_parallel(unsigned int threads_count)
 {
-    int current_position = this->position;
-    int start_position = this->position;
+    const int chunks_per_thread = 4;
 
-    char current_char = this->code.at(start_position);
-    char* next_char = get_char_at_position(this->code, start_position + 1);
+    if (threads_count < 2) return this->make_tokens();
 
-    if (current_char == ' ') return new Token(WHITESPACE, " ", start_position);
-    else if (current_char == '\n')
+    vector<int> boundaries = this->find_chunk_boundaries(threads_count * chunks_per_thread);
+    boundaries.push_back(this->code.size());
+
+    int chunks_count = boundaries.size() - 1;
+
+    vector<vector<Token>> chunks(chunks_count);
+    vector<exception_ptr> errors(chunks_count);
+
+    atomic<int> next_chunk(0);
+
+    auto worker = [&]() {
+        for (int chunk = next_chunk++; chunk < chunks_count; chunk = next_chunk++)
+        {
+            try
+            {
+                Lexer lexer(this->code, false);
+
+                lexer.position = boundaries[chunk];
+                lexer.tokens.reserve((boundaries[chunk + 1] - boundaries[chunk]) / 4 + 1);
+                lexer.lex_until(boundaries[chunk + 1]);
+
+                chunks[chunk] = move(lexer.tokens);
+            } catch (...)
+            {
+                errors[chunk] = current_exception();
+            }
+        }
+    };
+
+    vector<thread> pool;
+    for (unsigned int i = 1; i < min(threads_count, unsigned(chunks_count)); i++) pool.emplace_back(worker);
+
+    worker();
+
+    for (thread& pool_thread: pool) pool_thread.join();
+
+    // report the error a serial lexer would have hit first
+    for (exception_ptr error: errors)
     {
-        return new Token(NEWLINE, "\n", start_position);
+        if (error) rethrow_exception(error);
     }
 
-    if (is_char_quote(current_char)) 
+    size_t tokens_count = 0;
+    for (const vector<Token>& chunk: chunks) tokens_count += chunk.size();
+
+    this->tokens.clear();
+    this->tokens.reserve(tokens_count);
+
+    for (const vector<Token>& chunk: chunks) this->tokens.insert(this->tokens.end(), chunk.begin(), chunk.end());
+
+    this->position = this->code.size();
+
+    if (this->trace) this->trace_tokens();
+
+    return move(this->tokens);
+}
+
+vector<Token> Lexer::relex(const vector<Token>& previous, int edit_position, int removed_length, int inserted_length)
+{
+    int delta = inserted_length - removed_length;
+    int edit_end = edit_position + inserted_length;
+
+    // a token ending right at the edit may grow into it, so it is damaged too
+    auto damaged = lower_bound(previous.begin(), previous.end(), edit_position, [](const Token& token, int position) {
+        return token.end() < position;
+    });
+
+    size_t first_damaged = damaged - previous.begin();
+
+    auto relocate = [this](const Token& token, int shift) {
+        Token moved = token;
+
+        moved.position += shift;
+        moved.value = this->code.substr(moved.position + (token.type == STRING ? 1 : 0), token.value.size());
+
+        return moved;
+    };
+
+    this->tokens.clear();
+    this->tokens.reserve(previous.size() + inserted_length / 4 + 1);
+
+    for (size_t i = 0; i < first_damaged; i++) this->tokens.push_back(relocate(previous[i], 0));
+
+    this->position = edit_position;
+    if (first_damaged < previous.size() && previous[first_damaged].position < edit_position) this->position = previous[first_damaged].position;
+
+    size_t old_index = first_damaged;
+
+    while (true)
     {
-        string buffer;
-        bool is_quote_finded = false;
+        this->position = scan_whitespace(this->code, this->position);
+        if (this->position >= int(this->code.size())) break;
 
-        for (size_t i = start_position + 1; i < this->code.size(); ++i) 
+        // lexing only depends on the position, so once a token starts where an old
+        // token after the edit started, the rest of the old stream is still valid
+        if (this->position >= edit_end)
         {
-            current_position = i;
-            this->position = i;
+            int old_position = this->position - delta;
 
-            current_char = this->code.at(current_position);
+            while (old_index < previous.size() && previous[old_index].position < old_position) old_index++;
 
-            if (is_char_quote(current_char))
+            if (old_index < previous.size() && previous[old_index].position == old_position)
             {
-                is_quote_finded = true;
+                for (size_t i = old_index; i < previous.size(); i++) this->tokens.push_back(relocate(previous[i], delta));
                 break;
-            } else buffer.push_back(current_char);
+            }
         }
 
-        if (!is_quote_finded) throw runtime_error("String must have two quotes (" + buffer + ")");
+        this->tokens.push_back(this->next_token());
+        this->position++;
+    }
+
+    return move(this->tokens);
+}
+
+bool Lexer::pull(Token& token)
+{
+    this->position = scan_whitespace(this->code, this->position);
+    if (this->position >= int(this->code.size())) return false;
+
+    token = this->next_token();
+    this->position++;
+
+    return true;
+}
+
+TokenStream::TokenStream(Lexer* lexer)
+{
+    this->lexer = lexer;
+    this->lexed = 0;
+    this->is_finished = false;
+}
+
+Token* TokenStream::at(int index)
+{
+    if (index < this->lexed - TOKEN_LOOKAHEAD) throw runtime_error("Token " + to_string(index) + " is no longer in the lookahead window");
+
+    while (index >= this->lexed && !this->is_finished)
+    {
+        if (this->lexer->pull(this->window[this->lexed % TOKEN_LOOKAHEAD])) this->lexed++;
+        else this->is_finished = true;
+    }
+
+    if (index >= this->lexed) return nullptr;
+
+    return &this->window[index % TOKEN_LOOKAHEAD];
+}
+
+Token Lexer::make_token(TokenType type, int start_position, int length)
+{
+    Token token(type, this->code.substr(start_position, length), start_position);
+
+    if (type == DIGIT)
+    {
+        const char* begin = token.value.data();
+        const char* end = begin + token.value.size();
+
+        token.is_integer = token.value.find('.') == string_view::npos;
 
-        return new Token(STRING, buffer, start_position);
+        if (token.is_integer) from_chars(begin, end, token.integer_value);
+        else from_chars(begin, end, token.double_value);
+    }
+
+    return token;
+}
+
+Token Lexer::next_token()
+{
+    int current_position = this->position;
+    int start_position = this->position;
+
+    char current_char = this->code[start_position];
+    bool has_next_char = start_position + 1 < int(this->code.size());
+    char next_char = has_next_char ? this->code[start_position + 1] : '\0';
+
+    if (current_char == ' ') return this->make_token(WHITESPACE, start_position, 1);
+    else if (current_char == '\n')
+    {
+        return this->make_token(NEWLINE, start_position, 1);
+    }
+
+    if (is_char_quote(current_char))
+    {
+        size_t quote_position = scan_to_quote(this->code, start_position + 1);
+        bool is_quote_finded = quote_position < this->code.size();
+
+        this->position = is_quote_finded ? quote_position : this->code.size() - 1;
+
+        string_view buffer = this->code.substr(start_position + 1, quote_position - start_position - 1);
+
+        if (!is_quote_finded) throw runtime_error("String must have two quotes (" + string(buffer) + ")");
+
+        return Token(STRING, buffer, start_position);
     } else if (isdigit(current_char))
     {
-        string buffer;
-        for (size_t i = start_position; i < this->code.size(); ++i) 
+        int length = 0;
+        for (size_t i = start_position; i < this->code.size(); ++i)
         {
             current_position = i;
             this->position = i;
 
-            current_char = this->code.at(current_position);
+            current_char = this->code[current_position];
 
-            if (isdigit(current_char) || current_char == '.') buffer.push_back(current_char);
+            if (isdigit(current_char) || current_char == '.') length++;
             else
             {
                 this->position--;
@@ -104,135 +388,97 @@ Token* Lexer::next_token()
             };
         }
 
-        return new Token(DIGIT, buffer, start_position);
+        return this->make_token(DIGIT, start_position, length);
     } else if (current_char == ':')
     {
-        if (next_char && *next_char == '=')
+        if (next_char == '=')
         {
             this->position++;
-            return new Token(ASSIGN, ":=", start_position);
+            return this->make_token(ASSIGN, start_position, 2);
         }
 
-        return new Token(ANNOTATE, ":", start_position);
+        return this->make_token(ANNOTATE, start_position, 1);
     } else if (current_char == '?')
     {
-        if (next_char && *next_char == '=')
+        if (next_char == '=')
         {
             this->position++;
-            return new Token(EQ, "?=", start_position);
+            return this->make_token(EQ, start_position, 2);
         }
     } else if (current_char == '!')
     {
-        if (next_char && *next_char == '=')
+        if (next_char == '=')
         {
             this->position++;
-            return new Token(NOTEQ, "!=", start_position);
+            return this->make_token(NOTEQ, start_position, 2);
         }
 
-        return new Token(NOT, "!", start_position);
+        return this->make_token(NOT, start_position, 1);
     } else if (current_char == '>')
     {
-        if (next_char && *next_char == '=')
+        if (next_char == '=')
         {
             this->position++;
-            return new Token(BIGGER_OR_EQ, ">=", start_position);
+            return this->make_token(BIGGER_OR_EQ, start_position, 2);
         }
 
-        return new Token(BIGGER, ">", start_position);
+        return this->make_token(BIGGER, start_position, 1);
     } else if (current_char == '<')
     {
-        if (next_char && *next_char == '=')
+        if (next_char == '=')
         {
             this->position++;
-            return new Token(SMALLER_OR_EQ, "<=", start_position);
+            return this->make_token(SMALLER_OR_EQ, start_position, 2);
         }
 
-        return new Token(SMALLER, "<", start_position);
+        return this->make_token(SMALLER, start_position, 1);
     } else if (current_char == '-')
     {
-        if (next_char)
+        if (has_next_char)
         {
-            if (*next_char == '>')
+            if (next_char == '>')
             {
                 this->position++;
-                return new Token(ARROW, "->", start_position);
-            } else if (isdigit(*next_char))
+                return this->make_token(ARROW, start_position, 2);
+            } else if (isdigit(next_char))
             {
                 this->position++;
-                Token* number = this->next_token();
-                number->value = "-" + number->value;
+                Token number = this->next_token();
 
-                return number;
+                return this->make_token(DIGIT, start_position, number.value.size() + 1);
             }
         }
 
-        return new Token(MINUS, "-", start_position);
-    } 
+        return this->make_token(MINUS, start_position, 1);
+    }
 
-    else if (current_char == '+') return new Token(PLUS, "+", start_position);
-    else if (current_char == '/') return new Token(SLASH, "/", start_position);
-    else if (current_char == '*') return new Token(ASTERISK, "*", start_position); 
+    else if (current_char == '+') return this->make_token(PLUS, start_position, 1);
+    else if (current_char == '/') return this->make_token(SLASH, start_position, 1);
+    else if (current_char == '*') return this->make_token(ASTERISK, start_position, 1);
 
-    else if (current_char == '&') return new Token(AND, "&", start_position);
-    else if (current_char == '|') return new Token(OR, "|", start_position);
+    else if (current_char == '&') return this->make_token(AND, start_position, 1);
+    else if (current_char == '|') return this->make_token(OR, start_position, 1);
 
-    else if (current_char == '{')return new Token(BEGIN, "{", start_position); 
-    else if (current_char == '}') return new Token(END, "}", start_position);
+    else if (current_char == '{') return this->make_token(BEGIN, start_position, 1);
+    else if (current_char == '}') return this->make_token(END, start_position, 1);
 
-    else if (current_char == '(') return new Token(LPAREN, "(", start_position); 
-    else if (current_char == ')') return new Token(RPAREN, ")", start_position);
+    else if (current_char == '(') return this->make_token(LPAREN, start_position, 1);
+    else if (current_char == ')') return this->make_token(RPAREN, start_position, 1);
 
-    else if (current_char == '[') return new Token(LSQPAREN, "[", start_position); 
-    else if (current_char == ']') return new Token(RSQPAREN, "]", start_position);
+    else if (current_char == '[') return this->make_token(LSQPAREN, start_position, 1);
+    else if (current_char == ']') return this->make_token(RSQPAREN, start_position, 1);
 
-    else if (current_char == '.') return new Token(DOT, ".", start_position); 
-    else if (current_char == ',') return new Token(COMMA, ",", start_position);
-    else if (current_char == ';') return new Token(SEMICOLON, ";", start_position);
+    else if (current_char == '.') return this->make_token(DOT, start_position, 1);
+    else if (current_char == ',') return this->make_token(COMMA, start_position, 1);
+    else if (current_char == ';') return this->make_token(SEMICOLON, start_position, 1);
 
     else
     {
-        string buffer;
-        for (size_t i = start_position; i < this->code.size(); ++i) 
-        {
-            current_position = i;
-            this->position = i;
-
-            current_char = this->code.at(current_position);
-
-            if (!isalpha(current_char) && !isdigit(current_char) && current_char != '_')
-            {
-                this->position--;
-                break;
-            }
-
-            if (current_char == ' ') break;
+        int length = scan_identifier(this->code, start_position) - start_position;
+        this->position = start_position + length - 1;
 
-            buffer.push_back(current_char);
-
-            if (buffer == "fn") return new Token(FUNCTION, buffer, start_position);
-            else if (buffer == "return") return new Token(RETURN, buffer, start_position);
-            else if (buffer == "print") return new Token(PRINT, buffer, start_position);
-
-            else if (buffer == "if") return new Token(IF, buffer, start_position);
-            else if (buffer == "else") return new Token(ELSE, buffer, start_position);
-
-            else if (buffer == "while") return new Token(WHILE, buffer, start_position);
-            else if (buffer == "for") return new Token(FOR, buffer, start_position);
-
-            else if (buffer == "true") return new Token(TRUE, buffer, start_position);
-            else if (buffer == "false") return new Token(FALSE, buffer, start_position);
-            
-            else if (buffer == "nil") return new Token(NIL, buffer, start_position);
-
-            else if (buffer == "typedef") return new Token(TYPE, buffer, start_position);
-            
-            else if (buffer == "wait") return new Token(WAIT, buffer, start_position);
-        }
-
-        if (!buffer.empty()) return new Token(IDENTIFIER, buffer, start_position);
+        if (length > 0) return this->make_token(keyword_type(this->code.substr(start_position, length)), start_position, length);
     }
 
     throw runtime_error("Unexpected token '" + string { current_char } + "' at position " + to_string(start_position));
-
-    return nullptr;
-}
\ No newline at end of file
+}
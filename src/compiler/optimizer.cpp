@@ -0,0 +1,316 @@
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "../include/vm.h"
+#include "include/optimizer.h"
+
+using namespace std;
+
+const int MAX_OPTIMIZER_ROUNDS = 8;
+
+bool is_jump(Opcode opcode)
+{
+    return opcode == OP_JUMP || opcode == OP_JUMPIFNOT || opcode == OP_JUMPIFNOT_BOOL;
+}
+
+// Jump operands are relative to the jump, which is followed by the usual ip++
+int jump_target(const Bytecode& bytecode, int index)
+{
+    return index + bytecode[index].operand + 1;
+}
+
+int local_slot(const Instruction& instruction)
+{
+    return instruction.operand;
+}
+
+bool is_local_read(Opcode opcode)
+{
+    return opcode == OP_LOAD_LOCAL || opcode == OP_INC_LOCAL || opcode == OP_DEC_LOCAL;
+}
+
+vector<bool> find_jump_targets(const Bytecode& bytecode)
+{
+    int size = bytecode.size();
+
+    vector<bool> is_target(size + 1, false);
+
+    for (int i = 0; i < size; i++)
+    {
+        if (is_jump(bytecode[i].opcode)) is_target[jump_target(bytecode, i)] = true;
+    }
+
+    return is_target;
+}
+
+// Drops the removed instructions; jumps into a removed one land on the next kept one
+void compact(Bytecode& bytecode, const vector<bool>& removed)
+{
+    int size = bytecode.size();
+
+    vector<int> new_index(size + 1);
+
+    int kept = 0;
+    for (int i = 0; i < size; i++)
+    {
+        new_index[i] = kept;
+        if (!removed[i]) kept++;
+    }
+    new_index[size] = kept;
+
+    Bytecode compacted;
+    compacted.reserve(kept);
+
+    for (int i = 0; i < size; i++)
+    {
+        if (removed[i]) continue;
+
+        Instruction instruction = bytecode[i];
+
+        if (is_jump(instruction.opcode))
+        {
+            instruction.operand = new_index[jump_target(bytecode, i)] - new_index[i] - 1;
+        }
+
+        compacted.push_back(instruction);
+    }
+
+    bytecode = move(compacted);
+}
+
+bool thread_jumps(Bytecode& bytecode)
+{
+    int size = bytecode.size();
+    bool changed = false;
+
+    for (int i = 0; i < size; i++)
+    {
+        if (!is_jump(bytecode[i].opcode)) continue;
+
+        int target = jump_target(bytecode, i);
+        int final_target = target;
+
+        // bounded, so a jump cycle cannot hang the optimizer
+        for (int steps = 0; steps < size && final_target < size && bytecode[final_target].opcode == OP_JUMP; steps++)
+        {
+            final_target = jump_target(bytecode, final_target);
+        }
+
+        if (final_target != target)
+        {
+            bytecode[i].operand = final_target - i - 1;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+bool remove_jumps_to_next(Bytecode& bytecode)
+{
+    int size = bytecode.size();
+
+    vector<bool> removed(size, false);
+    bool changed = false;
+
+    for (int i = 0; i < size; i++)
+    {
+        if (bytecode[i].opcode == OP_JUMP && jump_target(bytecode, i) == i + 1)
+        {
+            removed[i] = true;
+            changed = true;
+        }
+    }
+
+    if (changed) compact(bytecode, removed);
+
+    return changed;
+}
+
+// write x, read x  =>  dup, write x
+bool store_with_dup(Bytecode& bytecode)
+{
+    vector<bool> is_target = find_jump_targets(bytecode);
+    bool changed = false;
+
+    int size = bytecode.size();
+
+    for (int i = 0; i + 1 < size; i++)
+    {
+        Instruction& store = bytecode[i];
+        Instruction& load = bytecode[i + 1];
+
+        if (is_target[i + 1]) continue;
+
+        bool is_same_local = store.opcode == OP_STORE_LOCAL && load.opcode == OP_LOAD_LOCAL && local_slot(store) == local_slot(load);
+        // names are interned, so the same name is the same constant
+        bool is_same_name = store.opcode == OP_WRITE_DATA && load.opcode == OP_READ_DATA && store.operand == load.operand;
+
+        if (is_same_local || is_same_name)
+        {
+            load = store;
+            store = Instruction(OP_DUP);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// Lowest index reachable from each instruction, found through the backward jumps
+// (loops) that start at or after it. Code before that index is never reached again.
+vector<int> find_lowest_reachable(const Bytecode& bytecode)
+{
+    int size = bytecode.size();
+
+    vector<pair<int, int>> back_jumps;
+
+    for (int i = 0; i < size; i++)
+    {
+        if (is_jump(bytecode[i].opcode) && jump_target(bytecode, i) <= i) back_jumps.push_back({ i, jump_target(bytecode, i) });
+    }
+
+    // lowest target among the back jumps from the k-th on
+    vector<int> lowest_target(back_jumps.size() + 1, size);
+    for (int k = int(back_jumps.size()) - 1; k >= 0; k--) lowest_target[k] = min(lowest_target[k + 1], back_jumps[k].second);
+
+    vector<int> lowest(size);
+
+    for (int i = 0; i < size; i++)
+    {
+        int reachable = i;
+
+        while (true)
+        {
+            auto first_jump = lower_bound(back_jumps.begin(), back_jumps.end(), make_pair(reachable, -1));
+            int target = lowest_target[first_jump - back_jumps.begin()];
+
+            if (target >= reachable) break;
+            reachable = target;
+        }
+
+        lowest[i] = reachable;
+    }
+
+    return lowest;
+}
+
+// pushv / dup followed by a store to a local that no path reads before it is stored again
+bool remove_dead_stores(Bytecode& bytecode)
+{
+    int size = bytecode.size();
+
+    vector<int> last_load;
+
+    for (int i = 0; i < size; i++)
+    {
+        if (!is_local_read(bytecode[i].opcode)) continue;
+
+        int slot = local_slot(bytecode[i]);
+
+        if (slot >= int(last_load.size())) last_load.resize(slot + 1, -1);
+        last_load[slot] = i;
+    }
+
+    vector<bool> is_target = find_jump_targets(bytecode);
+    vector<int> lowest_reachable = find_lowest_reachable(bytecode);
+
+    vector<bool> removed(size, false);
+    bool changed = false;
+
+    vector<int> visited_in(size, -1);
+
+    for (int i = 1; i < size; i++)
+    {
+        if (bytecode[i].opcode != OP_STORE_LOCAL || is_target[i] || removed[i - 1]) continue;
+        if (bytecode[i - 1].opcode != OP_PUSHV && bytecode[i - 1].opcode != OP_DUP) continue;
+
+        int slot = local_slot(bytecode[i]);
+        int slot_last_load = slot < int(last_load.size()) ? last_load[slot] : -1;
+
+        bool is_live = false;
+
+        vector<int> pending = { i + 1 };
+
+        while (!pending.empty() && !is_live)
+        {
+            int position = pending.back();
+            pending.pop_back();
+
+            if (position >= size || visited_in[position] == i) continue;
+            visited_in[position] = i;
+
+            // no load of the slot is reachable from here any more
+            if (lowest_reachable[position] > slot_last_load) continue;
+
+            const Instruction& instruction = bytecode[position];
+
+            if (is_local_read(instruction.opcode) && local_slot(instruction) == slot) is_live = true;
+            else if (instruction.opcode == OP_STORE_LOCAL && local_slot(instruction) == slot) continue;
+            else if (instruction.opcode == OP_RETURN || instruction.opcode == OP_TAILCALL) continue;
+            else if (instruction.opcode == OP_JUMP) pending.push_back(jump_target(bytecode, position));
+            else
+            {
+                if (is_jump(instruction.opcode)) pending.push_back(jump_target(bytecode, position));
+                pending.push_back(position + 1);
+            }
+        }
+
+        if (!is_live)
+        {
+            removed[i - 1] = true;
+            removed[i] = true;
+            changed = true;
+        }
+    }
+
+    if (changed) compact(bytecode, removed);
+
+    return changed;
+}
+
+void optimize_functions(Bytecode& bytecode, const ConstantPool& constants, int level, OptimizerReport& report)
+{
+    for (Instruction& instruction: bytecode)
+    {
+        if (instruction.opcode != OP_PUSHV) continue;
+
+        Function* function = dynamic_cast<Function*>(constants.constants[instruction.operand]);
+        if (!function) continue;
+
+        if (function->compile_body)
+        {
+            function->compile_body = [compile_body = function->compile_body, &constants, level](Function* target) {
+                OptimizerReport lazy_report;
+
+                compile_body(target);
+                optimize_bytecode(target->bytecode, constants, level, lazy_report);
+            };
+        } else optimize_bytecode(function->bytecode, constants, level, report);
+    }
+}
+
+void optimize_bytecode(Bytecode& bytecode, const ConstantPool& constants, int level, OptimizerReport& report)
+{
+    report.instructions_before += bytecode.size();
+
+    if (level > 0)
+    {
+        for (int round = 0; round < MAX_OPTIMIZER_ROUNDS; round++)
+        {
+            bool changed = thread_jumps(bytecode);
+
+            changed |= remove_jumps_to_next(bytecode);
+            changed |= store_with_dup(bytecode);
+
+            if (level > 1) changed |= remove_dead_stores(bytecode);
+
+            if (!changed) break;
+        }
+    }
+
+    optimize_functions(bytecode, constants, level, report);
+
+    report.instructions_after += bytecode.size();
+}
@@ -2,6 +2,10 @@
 #include <vector>
 #include <map>
 #include <array>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <climits>
 
 #include "include/lexer.h"
 #include "include/parser.h"
@@ -24,6 +28,7 @@ map<TokenType, string> token_types_names = {
     { ASSIGN, ":="},
 
     { ANNOTATE, ":" },
+    { TYPE, "typedef" },
 
     { EQ, "?=" },
     { NOTEQ, "!=" },
@@ -33,6 +38,9 @@ map<TokenType, string> token_types_names = {
 
     { BIGGER_OR_EQ, ">=" },
     { SMALLER_OR_EQ, "<=" },
+
+    { AND, "&" },
+    { OR, "|" },
     
     { NOT, "!" },
 
@@ -62,17 +70,18 @@ map<TokenType, string> token_types_names = {
 
     { WHITESPACE, "whitespace" },
     { SEMICOLON, "semicolon" },
+    { NEWLINE, "newline" },
 
     { WAIT, "wait" },
 };
 
-vector<TokenType> unary_token_types = {
+constexpr TokenSet unary_token_types = {
     RETURN,
     PRINT,
     WAIT
 };
 
-vector<TokenType> literal_token_types = {
+constexpr TokenSet literal_token_types = {
     NIL,
     TRUE,
     FALSE,
@@ -80,7 +89,7 @@ vector<TokenType> literal_token_types = {
     STRING,
 };
 
-vector<TokenType> binary_token_types = {
+constexpr TokenSet binary_token_types = {
     PLUS,
     MINUS,
     ASTERISK,
@@ -101,24 +110,104 @@ vector<TokenType> binary_token_types = {
     ASSIGN,
 };
 
-Parser::Parser(vector<Token*> tokens)
+struct BinaryOperator
+{
+    TokenType type;
+    int precedence;
+    bool is_right_associative;
+};
+
+constexpr BinaryOperator binary_operators[] = {
+    { ASSIGN, 1, true },
+
+    { AND, 2, false },
+    { OR, 2, false },
+
+    { EQ, 3, false },
+    { NOTEQ, 3, false },
+    { BIGGER, 3, false },
+    { SMALLER, 3, false },
+    { BIGGER_OR_EQ, 3, false },
+    { SMALLER_OR_EQ, 3, false },
+
+    { PLUS, 4, false },
+    { MINUS, 4, false },
+
+    { ASTERISK, 5, false },
+    { SLASH, 5, false },
+};
+
+struct PrecedenceTable
+{
+    BinaryOperator operators[TOKEN_TYPES_COUNT];
+};
+
+// indexed by TokenType, precedence 0 means the token is not a binary operator
+constexpr PrecedenceTable make_precedence_table()
+{
+    PrecedenceTable table {};
+
+    for (const BinaryOperator& binary_operator: binary_operators) table.operators[binary_operator.type] = binary_operator;
+
+    return table;
+}
+
+constexpr PrecedenceTable precedence_table = make_precedence_table();
+
+Parser::Parser(vector<Token> tokens, bool lazy_functions)
 {
     this->position = 0;
-    this->tokens = tokens;
+    this->lazy_functions = lazy_functions;
+    this->tokens = move(tokens);
+
+    this->root = this;
+    this->end = this->tokens.size();
 }
 
-bool Parser::is_token(vector<TokenType> types, int position)
+Parser::Parser(Parser* root, int begin, int end)
 {
-    if (position >= this->tokens.size()) return false;
+    this->position = begin;
+    this->lazy_functions = root->lazy_functions;
 
-    Token* at_pos = this->tokens.at(position);
-    TokenType type = at_pos->type;
+    this->root = root;
+    this->end = end;
+}
 
-    if (find(types.begin(), types.end(), type) != types.end()) return true;
-    return false;
+Parser::Parser(Lexer* lexer)
+{
+    this->position = 0;
+    this->lazy_functions = false;
+
+    this->root = this;
+    this->end = INT_MAX;
+
+    this->stream = make_unique<TokenStream>(lexer);
+}
+
+Token* Parser::token_at(int position)
+{
+    if (this->stream) return this->stream->at(position);
+    if (position >= this->end) return nullptr;
+
+    return &this->root->tokens[position];
+}
+
+// Tokens from a stream are overwritten by later ones, so nodes get their own copy
+Token* Parser::retain(Token* token)
+{
+    if (this->stream && token) return this->arena.make<Token>(*token);
+
+    return token;
 }
 
-bool Parser::match(vector<TokenType> types)
+bool Parser::is_token(TokenSet types, int position)
+{
+    Token* token = this->token_at(position);
+
+    return token && types.contains(token->type);
+}
+
+bool Parser::match(TokenSet types)
 {
     if (this->is_token(types, this->position))
     {
@@ -128,21 +217,25 @@ bool Parser::match(vector<TokenType> types)
     return false;
 }
 
-Token* Parser::eat(vector<TokenType> types)
+Token* Parser::eat(TokenSet types)
 {
-    string expected_tokens;
-    
-    for (TokenType type: types) expected_tokens += token_types_names[type] + " ";
-
-    Token* token = this->tokens.at(this->position);
-
     if (this->is_token(types, this->position))
     {
         this->position++;
-        return token;
+        return this->token_at(this->position - 1);
     }
-    
-    this->parser_errorf("Expected token: " + expected_tokens + ", given: " + token_types_names[token->type]);
+
+    string expected_tokens;
+
+    for (int type = 0; type < TOKEN_TYPES_COUNT; type++)
+    {
+        if (types.contains(TokenType(type))) expected_tokens += token_types_names[TokenType(type)] + " ";
+    }
+
+    Token* token = this->token_at(this->position);
+    string given = token ? token_types_names[token->type] : "end of file";
+
+    this->parser_errorf("Expected token: " + expected_tokens + ", given: " + given);
 
     return nullptr;
 }
@@ -152,20 +245,121 @@ void Parser::parser_errorf(string text)
     throw runtime_error("Syntax error: " + text + ", at position: " + to_string(this->position));
 }
 
-BlockNode* Parser::make_ast(bool trace)
+void Parser::parse_statements(BlockNode* block)
 {
-    BlockNode* ast = new BlockNode({});
-
-    while (this->position < this->tokens.size())
+    while (this->token_at(this->position))
     {
         AstNode* expression = this->parse_expression();
         if (expression)
         {
-            ast->nodes.push_back(expression);
+            block->nodes.push_back(expression);
             this->match({ SEMICOLON });
         }
         else break;
     }
+}
+
+BlockNode* Parser::make_ast(bool trace)
+{
+    BlockNode* ast = this->arena.make<BlockNode>(this->make_list<AstNode*>());
+
+    this->parse_statements(ast);
+
+    if (trace)
+    {
+        for (AstNode* node: ast->nodes) cout << node->tostring() << endl;
+    }
+
+    return ast;
+}
+
+// Token indices where a top-level `fn` declaration starts a new statement: outside any
+// brackets and right after a token that cannot be continued by an expression.
+vector<int> Parser::find_statement_boundaries()
+{
+    constexpr TokenSet statement_end_types = { END, RPAREN, RSQPAREN, SEMICOLON, IDENTIFIER, STRING, DIGIT, NIL, TRUE, FALSE };
+
+    vector<int> boundaries = { this->position };
+
+    int depth = 0;
+
+    for (int i = this->position; i < this->end; i++)
+    {
+        TokenType type = this->tokens[i].type;
+
+        if (type == BEGIN || type == LPAREN || type == LSQPAREN) depth++;
+        else if (type == END || type == RPAREN || type == RSQPAREN) depth--;
+        else if (type == FUNCTION && depth == 0 && i > boundaries.back() && statement_end_types.contains(this->tokens[i - 1].type)) boundaries.push_back(i);
+    }
+
+    return boundaries;
+}
+
+BlockNode* Parser::make_ast_parallel(bool trace, unsigned int threads_count)
+{
+    const int chunks_per_thread = 4;
+
+    if (threads_count < 2 || this->stream) return this->make_ast(trace);
+
+    vector<int> boundaries = this->find_statement_boundaries();
+
+    // merge neighbouring statements into chunks of roughly equal token counts
+    int chunk_size = (this->end - this->position) / (threads_count * chunks_per_thread) + 1;
+
+    vector<int> chunk_starts = { boundaries.front() };
+    for (int boundary: boundaries)
+    {
+        if (boundary - chunk_starts.back() >= chunk_size) chunk_starts.push_back(boundary);
+    }
+    chunk_starts.push_back(this->end);
+
+    int chunks_count = chunk_starts.size() - 1;
+
+    vector<BlockNode*> chunks(chunks_count);
+    vector<exception_ptr> errors(chunks_count);
+
+    this->workers.clear();
+    for (int chunk = 0; chunk < chunks_count; chunk++)
+    {
+        this->workers.push_back(unique_ptr<Parser>(new Parser(this, chunk_starts[chunk], chunk_starts[chunk + 1])));
+    }
+
+    atomic<int> next_chunk(0);
+
+    auto work = [&]() {
+        for (int chunk = next_chunk++; chunk < chunks_count; chunk = next_chunk++)
+        {
+            try
+            {
+                Parser* worker = this->workers[chunk].get();
+
+                chunks[chunk] = worker->arena.make<BlockNode>(worker->make_list<AstNode*>());
+                worker->parse_statements(chunks[chunk]);
+            } catch (...)
+            {
+                errors[chunk] = current_exception();
+            }
+        }
+    };
+
+    vector<thread> pool;
+    for (unsigned int i = 1; i < min(threads_count, unsigned(chunks_count)); i++) pool.emplace_back(work);
+
+    work();
+
+    for (thread& pool_thread: pool) pool_thread.join();
+
+    for (exception_ptr error: errors)
+    {
+        if (error) rethrow_exception(error);
+    }
+
+    // the nodes stay in the workers' arenas, which live as long as this parser
+    BlockNode* ast = this->arena.make<BlockNode>(this->make_list<AstNode*>());
+
+    for (BlockNode* chunk: chunks) ast->nodes.insert(ast->nodes.end(), chunk->nodes.begin(), chunk->nodes.end());
+
+    this->position = this->end;
 
     if (trace)
     {
@@ -177,9 +371,16 @@ BlockNode* Parser::make_ast(bool trace)
 
 AstNode* Parser::parse_expression(bool ignore_binaries)
 {   
-    AstNode* expression;
+    AstNode* expression = this->parse_postfix(this->parse_primary());
 
-    int started_position = this->position;
+    if (!ignore_binaries) expression = this->parse_binary(expression, 1);
+
+    return expression;
+}
+
+AstNode* Parser::parse_primary()
+{
+    AstNode* expression = nullptr;
 
     if (this->is_token({ FUNCTION }, this->position)) expression = this->parse_function();
     else if (this->is_token(literal_token_types, this->position)) expression = this->parse_literal();
@@ -192,11 +393,7 @@ AstNode* Parser::parse_expression(bool ignore_binaries)
     else if (this->is_token({ TYPE }, this->position)) expression = this->parse_typedef();
     else if (this->is_token({ IF }, this->position)) expression = this->parse_if();
 
-    if (expression)
-    {
-        AstNode* subparsed = this->subparse(expression, started_position, ignore_binaries);
-        if (subparsed) expression = subparsed;
-    } else this->parser_errorf("Cannot parse expression");
+    if (!expression) this->parser_errorf("Cannot parse expression");
 
     return expression;
 }
@@ -208,7 +405,7 @@ IfNode* Parser::parse_if()
     AstNode* condition = this->parse_expression();
     BlockNode* success_block = this->parse_block();
     
-    BlockNode* fail_block = new BlockNode({});
+    BlockNode* fail_block = this->arena.make<BlockNode>(this->make_list<AstNode*>());
 
     if (this->is_token({ ELSE }, this->position))
     {
@@ -217,14 +414,14 @@ IfNode* Parser::parse_if()
         fail_block = this->parse_block();
     }
 
-    return new IfNode(success_block, fail_block, condition);
+    return this->arena.make<IfNode>(success_block, fail_block, condition);
 }
 
 ObjectNode* Parser::parse_object()
 {
     eat({ BEGIN });
 
-    vector<AstNode*> fields;
+    ArenaVector<AstNode*> fields = this->make_list<AstNode*>();
 
     while (!this->is_token({ END }, this->position))
     {
@@ -238,14 +435,14 @@ ObjectNode* Parser::parse_object()
     
     this->eat({ END });
 
-    return new ObjectNode(fields);
+    return this->arena.make<ObjectNode>(move(fields));
 }
 
 ArrayNode* Parser::parse_array()
 {
     eat({ LSQPAREN });
 
-    vector<AstNode*> elements;
+    ArenaVector<AstNode*> elements = this->make_list<AstNode*>();
 
     while (!this->is_token({ RSQPAREN }, this->position))
     {
@@ -259,38 +456,19 @@ ArrayNode* Parser::parse_array()
     
     this->eat({ RSQPAREN });
 
-    return new ArrayNode(elements);
+    return this->arena.make<ArrayNode>(move(elements));
 }
 
-AstNode* Parser::subparse(AstNode* expression, int started_position, bool ignore_binaries)
+AstNode* Parser::parse_postfix(AstNode* expression)
 {
-    AstNode* subparsed = expression;
-    bool is_subparsed = false;
-
-    if (this->is_token({ LPAREN }, this->position))
+    while (true)
     {
-        is_subparsed = true;
-        subparsed = this->parse_call(expression);
-    }
-    else if (this->is_token({ LSQPAREN }, this->position)) 
-    {
-        is_subparsed = true;
-        subparsed = this->parse_indexation(expression);
-    }
-    else if (this->is_token(binary_token_types, this->position) && !ignore_binaries)
-    {
-        this->position = started_position;
-        is_subparsed = true;
-        subparsed = this->parse_binary();
-    }
-
-    if (is_subparsed)
-    {
-        AstNode* deep_subparsed = this->subparse(subparsed, started_position, ignore_binaries);
-        if (deep_subparsed) subparsed = deep_subparsed;
+        if (this->is_token({ LPAREN }, this->position)) expression = this->parse_call(expression);
+        else if (this->is_token({ LSQPAREN }, this->position)) expression = this->parse_indexation(expression);
+        else break;
     }
 
-    return subparsed;
+    return expression;
 }
 
 WhileNode* Parser::parse_while()
@@ -300,68 +478,41 @@ WhileNode* Parser::parse_while()
     AstNode* condition = this->parse_expression();
     BlockNode* block = this->parse_block();
 
-    return new WhileNode(condition, block);
-}
-
-AstNode* Parser::parse_binary()
-{
-    AstNode* left = this->headterm();
-
-    while (this->match({ AND, OR }))
-    {
-        Token* operator_token = this->tokens.at(this->position - 1);
-
-        AstNode* right = this->headterm();
-
-        left = new BinaryOperationNode(left, operator_token, right);
-    }
-
-    return left;
+    return this->arena.make<WhileNode>(condition, block);
 }
 
-AstNode* Parser::headterm()
+int Parser::binary_precedence_at(int position)
 {
-    AstNode* left = this->term();
-
-    while (this->match({ ASSIGN, EQ, NOTEQ, BIGGER, SMALLER, BIGGER_OR_EQ, SMALLER_OR_EQ }))
-    {
-        Token* operator_token = this->tokens.at(this->position - 1);
-
-        AstNode* right = this->term();
+    Token* token = this->token_at(position);
+    if (!token) return 0;
 
-        left = new BinaryOperationNode(left, operator_token, right);
-    }
-
-    return left;
+    return precedence_table.operators[token->type].precedence;
 }
 
-AstNode* Parser::term()
+// Precedence climbing: every operand is parsed exactly once, operators bind
+// according to precedence_table instead of a grammar rule per level.
+AstNode* Parser::parse_binary(AstNode* left, int min_precedence)
 {
-    AstNode* left = this->subterm();
-
-    while (this->match({ PLUS, MINUS }))
+    while (true)
     {
-        Token* operator_token = this->tokens.at(this->position - 1);
+        int precedence = this->binary_precedence_at(this->position);
+        if (precedence == 0 || precedence < min_precedence) break;
 
-        AstNode* right = this->subterm();
+        Token* operator_token = this->retain(this->eat(binary_token_types));
+        bool is_right_associative = precedence_table.operators[operator_token->type].is_right_associative;
 
-        left = new BinaryOperationNode(left, operator_token, right);
-    }
-
-    return left;
-}
-
-AstNode* Parser::subterm()
-{
-    AstNode* left = this->parse_expression(true);
+        AstNode* right = this->parse_expression(true);
 
-    while (this->match({ ASTERISK, SLASH }))
-    {
-        Token* operator_token = this->tokens.at(this->position - 1);
+        while (true)
+        {
+            int next_precedence = this->binary_precedence_at(this->position);
 
-        AstNode* right = this->parse_expression(true);
+            if (next_precedence > precedence) right = this->parse_binary(right, precedence + 1);
+            else if (is_right_associative && next_precedence == precedence) right = this->parse_binary(right, precedence);
+            else break;
+        }
 
-        left = new BinaryOperationNode(left, operator_token, right);
+        left = this->arena.make<BinaryOperationNode>(left, operator_token, right);
     }
 
     return left;
@@ -377,22 +528,22 @@ TypedefNode* Parser::parse_typedef()
 
     AstNode* type = this->parse_expression();
 
-    return new TypedefNode(id, type);
+    return this->arena.make<TypedefNode>(id, type);
 }
 
 UnaryOperationNode* Parser::parse_unary()
 {
-    Token* token = this->eat(unary_token_types);
+    Token* token = this->retain(this->eat(unary_token_types));
     AstNode* operand = this->parse_expression();
 
-    return new UnaryOperationNode(token, operand);
+    return this->arena.make<UnaryOperationNode>(token, operand);
 }
 
 CallNode* Parser::parse_call(AstNode* to_call)
 {
     eat({ LPAREN });
 
-    vector<AstNode*> args;
+    ArenaVector<AstNode*> args = this->make_list<AstNode*>();
 
     while (!this->is_token({ RPAREN }, this->position))
     {
@@ -406,7 +557,7 @@ CallNode* Parser::parse_call(AstNode* to_call)
     
     this->eat({ RPAREN });
 
-    return new CallNode(to_call, args);
+    return this->arena.make<CallNode>(to_call, move(args));
 }
 
 IndexationNode* Parser::parse_indexation(AstNode* where)
@@ -417,7 +568,7 @@ IndexationNode* Parser::parse_indexation(AstNode* where)
 
     eat({ RSQPAREN });
 
-    return new IndexationNode(where, index);
+    return this->arena.make<IndexationNode>(where, index);
 }
 
 ParenthisizedNode* Parser::parse_parenthisized()
@@ -428,7 +579,7 @@ ParenthisizedNode* Parser::parse_parenthisized()
 
     eat({ RPAREN });
 
-    return new ParenthisizedNode(expression);
+    return this->arena.make<ParenthisizedNode>(expression);
 }
 
 FunctionNode* Parser::parse_function()
@@ -439,7 +590,7 @@ FunctionNode* Parser::parse_function()
 
     this->eat({ LPAREN });
 
-    vector<IdentifierNode*> args;
+    ArenaVector<IdentifierNode*> args = this->make_list<IdentifierNode*>();
 
     while (!this->is_token({ RPAREN }, this->position))
     {
@@ -457,16 +608,16 @@ FunctionNode* Parser::parse_function()
 
     AstNode* return_type = this->parse_expression();
 
-    BlockNode* block = this->parse_block();
+    BlockNode* block = this->lazy_functions ? this->skip_block() : this->parse_block();
 
-    return new FunctionNode(identifier, args, block, return_type);
+    return this->arena.make<FunctionNode>(identifier, move(args), block, return_type);
 }
 
 BlockNode* Parser::parse_block()
 {
     this->eat({ BEGIN });
 
-    vector<AstNode*> nodes;
+    ArenaVector<AstNode*> nodes = this->make_list<AstNode*>();
 
     while (!this->is_token({ END }, this->position))
     {
@@ -480,25 +631,88 @@ BlockNode* Parser::parse_block()
 
     this->eat({ END });
 
-    return new BlockNode(nodes);
+    return this->arena.make<BlockNode>(move(nodes));
+}
+
+BlockNode* Parser::skip_block()
+{
+    this->eat({ BEGIN });
+
+    int begin = this->position;
+    int depth = 1;
+
+    for (Token* token; (token = this->token_at(this->position)); this->position++)
+    {
+        TokenType type = token->type;
+
+        if (type == BEGIN) depth++;
+        else if (type == END && --depth == 0) break;
+    }
+
+    int end = this->position;
+
+    this->eat({ END });
+
+    BlockNode* block = this->arena.make<BlockNode>(this->make_list<AstNode*>());
+
+    block->deferred_by = this->root;
+    block->deferred_begin = begin;
+    block->deferred_end = end;
+
+    return block;
+}
+
+void Parser::parse_deferred(BlockNode* block)
+{
+    if (block->deferred_by != this) return;
+
+    int saved_position = this->position;
+
+    // step back onto the opening brace so parse_block sees the whole block again
+    this->position = block->deferred_begin - 1;
+
+    BlockNode* parsed = this->parse_block();
+
+    block->nodes = move(parsed->nodes);
+    block->deferred_by = nullptr;
+
+    this->position = saved_position;
+}
+
+vector<string_view> Parser::deferred_identifiers(BlockNode* block)
+{
+    vector<string_view> identifiers;
+
+    if (block->deferred_by != this) return identifiers;
+
+    for (int i = block->deferred_begin; i < block->deferred_end; i++)
+    {
+        Token* token = this->token_at(i);
+
+        if (token && token->type == IDENTIFIER) identifiers.push_back(token->value);
+    }
+
+    return identifiers;
 }
 
 LiteralNode* Parser::parse_literal()
 {
-    return new LiteralNode(this->eat(literal_token_types));
+    return this->arena.make<LiteralNode>(this->retain(this->eat(literal_token_types)));
 }
 
 IdentifierNode* Parser::parse_identifier()
 {
-    Token* start = this->eat({ IDENTIFIER });
+    Token* start = this->retain(this->eat({ IDENTIFIER }));
     
     if (this->is_token({ ANNOTATE }, this->position))
     {
         this->eat({ ANNOTATE });
-        AstNode* type = this->parse_expression();
 
-        return new IdentifierNode(start, type);
+        // `x: int := 5` annotates x, the assignment is not part of the type
+        AstNode* type = this->parse_expression(true);
+
+        return this->arena.make<IdentifierNode>(start, type);
     }
 
-    return new IdentifierNode(start);
+    return this->arena.make<IdentifierNode>(start);
 }
\ No newline at end of file
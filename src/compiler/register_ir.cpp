@@ -0,0 +1,400 @@
+#include <vector>
+#include <map>
+#include <memory>
+
+#include "../include/vm.h"
+#include "include/optimizer.h"
+#include "include/register_ir.h"
+
+using namespace std;
+
+// Stack code is lowered by running it symbolically: the stack holds the registers the
+// values are in. Locals and constants are not copied when pushed, values computed at
+// stack position i go to temporary i. Constants get their registers at the end, until
+// then they are numbered below zero.
+class RegisterLowering
+{
+    private:
+        const Bytecode& bytecode;
+        const ConstantPool& constants;
+        int locals_count;
+
+        RegisterCode code;
+        vector<int> stack;
+        int max_depth = 0;
+
+        map<Object*, int> constant_numbers;
+
+        int temporary(int position) { return this->locals_count + position; }
+
+        int constant(Object* value)
+        {
+            auto number = this->constant_numbers.find(value);
+            if (number != this->constant_numbers.end()) return number->second;
+
+            this->code.constants.push_back(value);
+
+            return this->constant_numbers[value] = -int(this->code.constants.size());
+        }
+
+        void emit(Opcode opcode, int target, int left = 0, int right = 0)
+        {
+            RegisterInstruction instruction;
+
+            instruction.opcode = opcode;
+            instruction.target = target;
+            instruction.left = left;
+            instruction.right = right;
+
+            this->code.instructions.push_back(instruction);
+        }
+
+        void push(int value)
+        {
+            this->stack.push_back(value);
+            this->max_depth = max(this->max_depth, int(this->stack.size()));
+        }
+
+        bool pop(int& value)
+        {
+            if (this->stack.empty()) return false;
+
+            value = this->stack.back();
+            this->stack.pop_back();
+
+            return true;
+        }
+
+        // the local is about to change, so stacked reads of it take its current value
+        void detach_local(int slot)
+        {
+            int depth = this->stack.size();
+
+            for (int i = 0; i < depth; i++)
+            {
+                if (this->stack[i] != slot) continue;
+
+                this->emit(OP_LOAD_LOCAL, this->temporary(i), slot);
+                this->stack[i] = this->temporary(i);
+            }
+        }
+
+        // values taken from consecutive registers are copied to the temporaries of their positions
+        bool take_values(int count, int& first)
+        {
+            int depth = this->stack.size();
+            if (count > depth) return false;
+
+            int begin = depth - count;
+
+            for (int i = begin; i < depth; i++)
+            {
+                if (this->stack[i] != this->temporary(i)) this->emit(OP_LOAD_LOCAL, this->temporary(i), this->stack[i]);
+            }
+
+            this->stack.resize(begin);
+            first = this->temporary(begin);
+
+            return true;
+        }
+
+        bool is_arithmetic(Opcode opcode)
+        {
+            return (opcode >= OP_ADD && opcode <= OP_DIV) || (opcode >= OP_AND && opcode <= OP_SMALLEROREQ) || (opcode >= OP_ADD_INT && opcode <= OP_GE_DOUBLE);
+        }
+
+        bool lower_instruction(const Instruction& instruction, int index);
+    public:
+        RegisterLowering(const Bytecode& bytecode, const ConstantPool& constants, int locals_count) : bytecode(bytecode), constants(constants) { this->locals_count = locals_count; };
+
+        shared_ptr<RegisterCode> lower();
+};
+
+bool RegisterLowering::lower_instruction(const Instruction& instruction, int index)
+{
+    Opcode opcode = instruction.opcode;
+
+    if (this->is_arithmetic(opcode))
+    {
+        int left, right;
+        if (!this->pop(right) || !this->pop(left)) return false;
+
+        int target = this->temporary(this->stack.size());
+
+        this->emit(opcode, target, left, right);
+        this->push(target);
+
+        return true;
+    }
+
+    switch (opcode)
+    {
+        case OP_LOAD_LOCAL:
+            {
+                this->push(instruction.operand);
+            }
+            break;
+        case OP_PUSHV:
+            {
+                this->push(this->constant(this->constants.constants[instruction.operand]));
+            }
+            break;
+        case OP_DUP:
+            {
+                if (this->stack.empty()) return false;
+
+                this->push(this->stack.back());
+            }
+            break;
+        case OP_STORE_LOCAL:
+            {
+                int slot = instruction.operand;
+
+                int value;
+                if (!this->pop(value)) return false;
+
+                this->detach_local(slot);
+
+                // an operation whose result is only stored writes the local itself
+                RegisterInstruction* last = this->code.instructions.empty() ? nullptr : &this->code.instructions.back();
+
+                bool is_result_stored = last && this->is_arithmetic(last->opcode) && last->target == value && value == this->temporary(this->stack.size());
+
+                for (int stacked: this->stack) is_result_stored = is_result_stored && stacked != value;
+
+                if (is_result_stored) last->target = slot;
+                else this->emit(OP_STORE_LOCAL, slot, value);
+            }
+            break;
+        case OP_INC_LOCAL:
+        case OP_DEC_LOCAL:
+            {
+                int slot = instruction.operand;
+
+                this->detach_local(slot);
+                this->emit(opcode, slot);
+            }
+            break;
+        case OP_READ_DATA:
+            {
+                int target = this->temporary(this->stack.size());
+
+                this->emit(OP_READ_DATA, target, 0, instruction.operand);
+                this->push(target);
+            }
+            break;
+        case OP_WRITE_DATA:
+            {
+                int value;
+                if (!this->pop(value)) return false;
+
+                this->emit(OP_WRITE_DATA, 0, value, instruction.operand);
+            }
+            break;
+        case OP_READINDEX:
+            {
+                int object, index;
+                if (!this->pop(object) || !this->pop(index)) return false;
+
+                int target = this->temporary(this->stack.size());
+
+                this->emit(OP_READINDEX, target, object, index);
+                this->push(target);
+            }
+            break;
+        case OP_SETINDEX:
+            {
+                int object, value, index;
+                if (!this->pop(object) || !this->pop(value) || !this->pop(index)) return false;
+
+                this->emit(OP_SETINDEX, object, index, value);
+            }
+            break;
+        case OP_CALL:
+            {
+                // arguments counted by the compiler, the VM itself takes as many as the function has
+                int arguments_count = instruction.operand;
+
+                int function, first;
+                if (!this->pop(function) || !this->take_values(arguments_count, first)) return false;
+
+                this->emit(OP_CALL, first, function, arguments_count);
+                this->push(first);
+            }
+            break;
+        case OP_GETFIELD:
+            {
+                int object;
+                if (!this->pop(object)) return false;
+
+                int target = this->temporary(this->stack.size());
+
+                this->emit(OP_GETFIELD, target, object, instruction.operand);
+                this->push(target);
+            }
+            break;
+        case OP_SETFIELD:
+            {
+                int object, value;
+                if (!this->pop(object) || !this->pop(value)) return false;
+
+                this->emit(OP_SETFIELD, object, value, instruction.operand);
+            }
+            break;
+        case OP_MAKE_RECORD:
+            {
+                RecordLayout* layout = static_cast<RecordLayout*>(this->constants.constants[instruction.operand]);
+                int first;
+
+                if (!this->take_values(layout->fields.size(), first)) return false;
+
+                this->emit(OP_MAKE_RECORD, first, 0, instruction.operand);
+                this->push(first);
+            }
+            break;
+        case OP_MAKE_ARRAY:
+        case OP_MAKE_OBJECT:
+            {
+                int count = instruction.operand;
+                int first;
+
+                if (!this->take_values(opcode == OP_MAKE_OBJECT ? 2 * count : count, first)) return false;
+
+                this->emit(opcode, first, 0, count);
+                this->push(first);
+            }
+            break;
+        case OP_JUMP:
+            {
+                if (!this->stack.empty()) return false;
+
+                this->emit(OP_JUMP, jump_target(this->bytecode, index));
+            }
+            break;
+        case OP_JUMPIFNOT:
+        case OP_JUMPIFNOT_BOOL:
+            {
+                int condition;
+                if (!this->pop(condition) || !this->stack.empty()) return false;
+
+                this->emit(opcode, jump_target(this->bytecode, index), condition);
+            }
+            break;
+        case OP_RETURN:
+            {
+                int value;
+                if (!this->pop(value)) return false;
+
+                this->emit(OP_RETURN, 0, value);
+
+                // values left below the result stay behind on the stack VM too, and nothing after runs
+                this->stack.clear();
+            }
+            break;
+        case OP_PRINT:
+        case OP_WAIT:
+            {
+                int value;
+                if (!this->pop(value)) return false;
+
+                this->emit(opcode, 0, value);
+            }
+            break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+shared_ptr<RegisterCode> RegisterLowering::lower()
+{
+    int size = this->bytecode.size();
+
+    vector<bool> is_target(size + 1, false);
+    for (int i = 0; i < size; i++)
+    {
+        if (is_jump(this->bytecode[i].opcode)) is_target[jump_target(this->bytecode, i)] = true;
+    }
+
+    // register instruction each stack instruction starts at
+    vector<int> starts(size + 1);
+
+    for (int i = 0; i < size; i++)
+    {
+        // statements leave the stack empty, so nothing is stacked where control flow joins
+        if (is_target[i] && !this->stack.empty()) return nullptr;
+
+        starts[i] = this->code.instructions.size();
+
+        if (!this->lower_instruction(this->bytecode[i], i)) return nullptr;
+    }
+
+    // a function ending without return gives the caller whatever is left on the stack
+    if (!this->stack.empty()) return nullptr;
+
+    starts[size] = this->code.instructions.size();
+
+    this->code.constants_base = this->locals_count + this->max_depth;
+    this->code.registers_count = this->code.constants_base + this->code.constants.size();
+
+    auto place_constant = [this](int& operand) {
+        if (operand < 0) operand = this->code.constants_base - operand - 1;
+    };
+
+    for (RegisterInstruction& instruction: this->code.instructions)
+    {
+        if (is_jump(instruction.opcode)) instruction.target = starts[instruction.target];
+        else place_constant(instruction.target);
+
+        place_constant(instruction.left);
+
+        // counts, field operands and pool indices are not registers
+        bool is_right_register = instruction.opcode != OP_CALL && instruction.opcode != OP_MAKE_ARRAY && instruction.opcode != OP_MAKE_OBJECT
+            && instruction.opcode != OP_MAKE_RECORD && instruction.opcode != OP_GETFIELD && instruction.opcode != OP_SETFIELD
+            && instruction.opcode != OP_READ_DATA && instruction.opcode != OP_WRITE_DATA;
+
+        if (is_right_register) place_constant(instruction.right);
+    }
+
+    return make_shared<RegisterCode>(move(this->code));
+}
+
+shared_ptr<RegisterCode> lower_to_registers(const Bytecode& bytecode, const ConstantPool& constants, int locals_count)
+{
+    RegisterLowering lowering(bytecode, constants, locals_count);
+
+    return lowering.lower();
+}
+
+void lower_functions(const Bytecode& bytecode, const ConstantPool& constants, RegisterReport& report)
+{
+    for (const Instruction& instruction: bytecode)
+    {
+        if (instruction.opcode != OP_PUSHV) continue;
+
+        Function* function = dynamic_cast<Function*>(constants.constants[instruction.operand]);
+        if (!function) continue;
+
+        report.functions++;
+
+        if (function->compile_body)
+        {
+            function->compile_body = [compile_body = function->compile_body, &constants](Function* target) {
+                RegisterReport lazy_report;
+
+                compile_body(target);
+
+                target->register_code = lower_to_registers(target->bytecode, constants, target->locals_count);
+                lower_functions(target->bytecode, constants, lazy_report);
+            };
+
+            continue;
+        }
+
+        function->register_code = lower_to_registers(function->bytecode, constants, function->locals_count);
+        if (function->register_code) report.lowered_functions++;
+
+        lower_functions(function->bytecode, constants, report);
+    }
+}
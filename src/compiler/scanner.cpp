@@ -0,0 +1,269 @@
+#include <string_view>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FEMIRA_SCANNER_X86
+#include <immintrin.h>
+#endif
+
+#include "include/scanner.h"
+
+using namespace std;
+
+// Runs are scanned by the scalar loop first; only the ones still going after this
+// many bytes are handed to a vector kernel, shorter ones do not repay its setup.
+const size_t VECTOR_SCAN_MIN_RUN = 16;
+
+typedef size_t (*RunScanner)(const char* data, size_t size, size_t position);
+
+bool is_whitespace_byte(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+bool is_identifier_byte(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+bool is_quote_byte(char c)
+{
+    return c == '\'' || c == '\"';
+}
+
+size_t scalar_scan_whitespace(const char* data, size_t size, size_t position)
+{
+    while (position < size && is_whitespace_byte(data[position])) position++;
+    return position;
+}
+
+size_t scalar_scan_identifier(const char* data, size_t size, size_t position)
+{
+    while (position < size && is_identifier_byte(data[position])) position++;
+    return position;
+}
+
+size_t scalar_scan_to_quote(const char* data, size_t size, size_t position)
+{
+    while (position < size && !is_quote_byte(data[position])) position++;
+    return position;
+}
+
+#ifdef FEMIRA_SCANNER_X86
+
+// Bytes in [low, low + span] give 0xFF lanes; unsigned compare via min.
+__m128i sse2_in_range(__m128i bytes, char low, char span)
+{
+    __m128i shifted = _mm_sub_epi8(bytes, _mm_set1_epi8(low));
+    return _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(span)), shifted);
+}
+
+__m128i sse2_whitespace_mask(__m128i bytes)
+{
+    __m128i space = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '));
+    __m128i newline = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'));
+    __m128i tab = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t'));
+    __m128i carriage = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r'));
+
+    return _mm_or_si128(_mm_or_si128(space, newline), _mm_or_si128(tab, carriage));
+}
+
+__m128i sse2_identifier_mask(__m128i bytes)
+{
+    __m128i letter = sse2_in_range(_mm_or_si128(bytes, _mm_set1_epi8(0x20)), 'a', 'z' - 'a');
+    __m128i digit = sse2_in_range(bytes, '0', '9' - '0');
+    __m128i underscore = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_'));
+
+    return _mm_or_si128(_mm_or_si128(letter, digit), underscore);
+}
+
+__m128i sse2_quote_mask(__m128i bytes)
+{
+    __m128i single_quote = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\''));
+    __m128i double_quote = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\"'));
+
+    return _mm_or_si128(single_quote, double_quote);
+}
+
+// Advances while the mask holds (or, with stop_on_match, until it first holds).
+template <__m128i (*mask_of)(__m128i), bool stop_on_match>
+size_t sse2_scan(const char* data, size_t size, size_t position)
+{
+    while (position + 16 <= size)
+    {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + position));
+        unsigned int mask = _mm_movemask_epi8(mask_of(bytes));
+
+        if (!stop_on_match) mask = ~mask & 0xFFFF;
+        if (mask) return position + __builtin_ctz(mask);
+
+        position += 16;
+    }
+
+    return position;
+}
+
+__attribute__((target("avx2"))) __m256i avx2_in_range(__m256i bytes, char low, char span)
+{
+    __m256i shifted = _mm256_sub_epi8(bytes, _mm256_set1_epi8(low));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8(span)), shifted);
+}
+
+__attribute__((target("avx2"))) __m256i avx2_whitespace_mask(__m256i bytes)
+{
+    __m256i space = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' '));
+    __m256i newline = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n'));
+    __m256i tab = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\t'));
+    __m256i carriage = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\r'));
+
+    return _mm256_or_si256(_mm256_or_si256(space, newline), _mm256_or_si256(tab, carriage));
+}
+
+__attribute__((target("avx2"))) __m256i avx2_identifier_mask(__m256i bytes)
+{
+    __m256i letter = avx2_in_range(_mm256_or_si256(bytes, _mm256_set1_epi8(0x20)), 'a', 'z' - 'a');
+    __m256i digit = avx2_in_range(bytes, '0', '9' - '0');
+    __m256i underscore = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('_'));
+
+    return _mm256_or_si256(_mm256_or_si256(letter, digit), underscore);
+}
+
+__attribute__((target("avx2"))) __m256i avx2_quote_mask(__m256i bytes)
+{
+    __m256i single_quote = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\''));
+    __m256i double_quote = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\"'));
+
+    return _mm256_or_si256(single_quote, double_quote);
+}
+
+template <__m256i (*mask_of)(__m256i), bool stop_on_match>
+__attribute__((target("avx2"))) size_t avx2_scan(const char* data, size_t size, size_t position)
+{
+    while (position + 32 <= size)
+    {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + position));
+        unsigned int mask = _mm256_movemask_epi8(mask_of(bytes));
+
+        if (!stop_on_match) mask = ~mask;
+        if (mask) return position + __builtin_ctz(mask);
+
+        position += 32;
+    }
+
+    return position;
+}
+
+#endif
+
+ScannerKernel detect_scanner_kernel()
+{
+#ifdef FEMIRA_SCANNER_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) return SCAN_AVX2;
+    if (__builtin_cpu_supports("sse2")) return SCAN_SSE2;
+#endif
+
+    return SCAN_SCALAR;
+}
+
+// The vector loops stop short of the last partial block, the scalar loop finishes it.
+template <RunScanner vector_scan, RunScanner scalar_scan>
+size_t vector_then_scalar(const char* data, size_t size, size_t position)
+{
+    return scalar_scan(data, size, vector_scan(data, size, position));
+}
+
+struct RunScanners
+{
+    RunScanner whitespace;
+    RunScanner identifier;
+    RunScanner to_quote;
+};
+
+RunScanners scanners_of(ScannerKernel kernel)
+{
+#ifdef FEMIRA_SCANNER_X86
+    if (kernel == SCAN_AVX2)
+    {
+        return {
+            vector_then_scalar<avx2_scan<avx2_whitespace_mask, false>, scalar_scan_whitespace>,
+            vector_then_scalar<avx2_scan<avx2_identifier_mask, false>, scalar_scan_identifier>,
+            vector_then_scalar<avx2_scan<avx2_quote_mask, true>, scalar_scan_to_quote>,
+        };
+    }
+
+    if (kernel == SCAN_SSE2)
+    {
+        return {
+            vector_then_scalar<sse2_scan<sse2_whitespace_mask, false>, scalar_scan_whitespace>,
+            vector_then_scalar<sse2_scan<sse2_identifier_mask, false>, scalar_scan_identifier>,
+            vector_then_scalar<sse2_scan<sse2_quote_mask, true>, scalar_scan_to_quote>,
+        };
+    }
+#endif
+
+    return { scalar_scan_whitespace, scalar_scan_identifier, scalar_scan_to_quote };
+}
+
+ScannerKernel best_scanner_kernel()
+{
+    static ScannerKernel best = detect_scanner_kernel();
+    return best;
+}
+
+// picked once at startup, the scanners call through these without checking the kernel again
+ScannerKernel active_scanner_kernel = best_scanner_kernel();
+RunScanners active_scanners = scanners_of(active_scanner_kernel);
+
+ScannerKernel get_scanner_kernel()
+{
+    return active_scanner_kernel;
+}
+
+void set_scanner_kernel(ScannerKernel kernel)
+{
+    active_scanner_kernel = kernel <= best_scanner_kernel() ? kernel : best_scanner_kernel();
+    active_scanners = scanners_of(active_scanner_kernel);
+}
+
+const char* scanner_kernel_name(ScannerKernel kernel)
+{
+    switch (kernel)
+    {
+        case SCAN_AVX2:
+            return "avx2";
+        case SCAN_SSE2:
+            return "sse2";
+        default:
+            return "scalar";
+    }
+}
+
+size_t scan_run(string_view code, size_t position, RunScanner scalar_scan, RunScanner kernel_scan)
+{
+    const char* data = code.data();
+    size_t size = code.size();
+
+    size_t short_run_end = min(size, position + VECTOR_SCAN_MIN_RUN);
+
+    position = scalar_scan(data, short_run_end, position);
+    if (position < short_run_end) return position;
+
+    return kernel_scan(data, size, position);
+}
+
+size_t scan_whitespace(string_view code, size_t position)
+{
+    return scan_run(code, position, scalar_scan_whitespace, active_scanners.whitespace);
+}
+
+size_t scan_identifier(string_view code, size_t position)
+{
+    return scan_run(code, position, scalar_scan_identifier, active_scanners.identifier);
+}
+
+size_t scan_to_quote(string_view code, size_t position)
+{
+    return scan_run(code, position, scalar_scan_to_quote, active_scanners.to_quote);
+}
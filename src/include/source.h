@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+// Read-only script text. The file is mapped into memory where the platform
+// allows it and read with a single call otherwise, so the lexer works on the
+// original bytes (newlines included) without any intermediate copies.
+class SourceFile
+{
+    private:
+        const char* data = nullptr;
+        size_t size = 0;
+        bool is_mapped = false;
+
+        string buffer;
+    public:
+        bool load(const string& path);
+        string_view view() const;
+
+        SourceFile() = default;
+        ~SourceFile();
+
+        SourceFile(const SourceFile&) = delete;
+        SourceFile& operator=(const SourceFile&) = delete;
+};
@@ -5,6 +5,8 @@
 #include <vector>
 #include <stack>
 #include <map>
+#include <memory>
+#include <functional>
 
 using namespace std;
 
@@ -44,6 +46,48 @@ enum Opcode
 
     OP_NEWARRAY = 0x24,
     OP_NEWOBJECT = 0x25,
+
+    OP_LOAD_LOCAL = 0x26,
+    OP_STORE_LOCAL = 0x27,
+
+    OP_DUP = 0x28,
+
+    OP_MAKE_ARRAY = 0x29,
+    OP_MAKE_OBJECT = 0x2A,
+
+    // operands are known to be integers / doubles at compile time
+    OP_ADD_INT = 0x30,
+    OP_SUB_INT = 0x31,
+    OP_MUL_INT = 0x32,
+    OP_DIV_INT = 0x33,
+    OP_LT_INT = 0x34,
+    OP_GT_INT = 0x35,
+    OP_LE_INT = 0x36,
+    OP_GE_INT = 0x37,
+
+    OP_ADD_DOUBLE = 0x38,
+    OP_SUB_DOUBLE = 0x39,
+    OP_MUL_DOUBLE = 0x3A,
+    OP_DIV_DOUBLE = 0x3B,
+    OP_LT_DOUBLE = 0x3C,
+    OP_GT_DOUBLE = 0x3D,
+    OP_LE_DOUBLE = 0x3E,
+    OP_GE_DOUBLE = 0x3F,
+
+    // the condition is known to be a boolean
+    OP_JUMPIFNOT_BOOL = 0x40,
+
+    // local known to hold an integer: local := local + 1 / local - 1
+    OP_INC_LOCAL = 0x41,
+    OP_DEC_LOCAL = 0x42,
+
+    // call whose result is returned right away, runs in the frame of the caller
+    OP_TAILCALL = 0x43,
+
+    // objects of a typedef'd type, fields are read and written by slot
+    OP_MAKE_RECORD = 0x44,
+    OP_GETFIELD = 0x45,
+    OP_SETFIELD = 0x46,
 };
 
 struct Object
@@ -59,7 +103,11 @@ struct Memory
     map<string, Object*> cells;
     vector<Memory*> sub_memories;
 
-    Memory* parent;
+    Memory* parent = nullptr;
+
+    // set when a function stored here got this memory as the one it runs in, so a
+    // tail call cannot refill it for another function
+    bool is_captured = false;
 
     void write_data(string key, Object* value)
     {
@@ -95,15 +143,55 @@ struct Memory
 struct Instruction
 {
     Opcode opcode;
-    Object* data;
 
-    Instruction(Opcode opcode, Object* data = nullptr) { this->opcode = opcode; this->data = data; };
+    // jump offset, local slot, element / argument count, field operand, or the
+    // index of the constant, name or record layout in the constant pool
+    int operand = 0;
+
+    Instruction(Opcode opcode, int operand = 0) { this->opcode = opcode; this->operand = operand; };
 
     Instruction() = default;
 };
 
+// Getfield and setfield carry the pool index of the record layout above the field
+// slot in one operand, so a record has at most MAX_RECORD_FIELDS fields
+const int FIELD_SLOT_BITS = 8;
+const int MAX_RECORD_FIELDS = 1 << FIELD_SLOT_BITS;
+const int MAX_FIELD_LAYOUT_INDEX = (1 << (31 - FIELD_SLOT_BITS)) - 1;
+
+inline int field_operand(int layout_index, int slot) { return layout_index << FIELD_SLOT_BITS | slot; }
+inline int field_layout_index(int operand) { return operand >> FIELD_SLOT_BITS; }
+inline int field_slot(int operand) { return operand & (MAX_RECORD_FIELDS - 1); }
+
 using Bytecode = vector<Instruction>;
 
+// Three-address form of compiled code. Operands are registers, slots of one frame
+// that holds the locals, then a temporary for every stack position, then the
+// constants. Binary operations compute target from left and right, jumps go to
+// the instruction at target, calls and array / object literals take right values
+// from the registers starting at target and leave their result there, and setindex
+// writes right at index left of target. Memory reads and writes and records have
+// the pool index of their name or layout in right, field accesses their field
+// operand.
+struct RegisterInstruction
+{
+    Opcode opcode;
+
+    int target = 0;
+    int left = 0;
+    int right = 0;
+};
+
+struct RegisterCode
+{
+    vector<RegisterInstruction> instructions;
+
+    vector<Object*> constants;
+    int constants_base = 0;
+
+    int registers_count = 0;
+};
+
 struct Null : Object 
 {
     string tostring() override 
@@ -131,6 +219,9 @@ struct String : Object
 
     bool is_eq(Object* with) override
     {
+        // interned constants are equal exactly when they are the same object
+        if (with == this) return true;
+
         if (String* string = dynamic_cast<String*>(with))
         {
             return string->data == this->data;
@@ -191,6 +282,16 @@ struct Function : Object
     vector<string> args_ids;
     Memory* defined_in;
 
+    // frame slot of each argument, -1 for arguments that live in memory by name
+    vector<int> args_slots;
+    int locals_count = 0;
+
+    // set for functions whose body is compiled on the first call, fills the fields above
+    function<void(Function*)> compile_body;
+
+    // the body lowered for the register VM, nullptr when it runs on the stack VM
+    shared_ptr<RegisterCode> register_code;
+
     Function(Bytecode bytecode, int args_number) { this->bytecode = bytecode; };
 
     string tostring() override 
@@ -228,6 +329,37 @@ struct ObjectDataStructure : Object
     }
 };
 
+// Fields of a typedef'd object type in slot order, names are interned constants
+struct RecordLayout : Object
+{
+    string type_name;
+
+    // where getfield, setfield and make_record find the layout
+    int constant_index = -1;
+
+    vector<String*> fields;
+    map<string, int> slots;
+
+    string tostring() override
+    {
+        return "record layout " + this->type_name;
+    }
+};
+
+// Object of a typedef'd type, its fields live in a fixed slot array
+struct Record : Object
+{
+    RecordLayout* layout;
+    vector<Object*> values;
+
+    Record(RecordLayout* layout) : values(layout->fields.size()) { this->layout = layout; };
+
+    string tostring() override
+    {
+        return "object (data structure)";
+    }
+};
+
 struct Boolean : Object
 {
     bool data;
@@ -250,17 +382,69 @@ struct Boolean : Object
     }
 };
 
+// Constants of one compiled program, shared by all of its functions. Names and
+// literals with the same value are a single object, so instructions refer to them
+// by index and equal strings from the code are the same pointer.
+struct ConstantPool
+{
+    vector<Object*> constants;
+
+    map<string, int> strings;
+    map<int, int> integers;
+    // by bit pattern, so 0.0 and -0.0 stay apart
+    map<unsigned long long, int> doubles;
+    int booleans[2] = { -1, -1 };
+    int null = -1;
+
+    // deduplicates strings, numbers, booleans and nil, anything else is added as is
+    int intern(Object* value);
+    int intern_string(const string& value);
+
+    int add(Object* value);
+};
+
+// Result of a binary opcode with the VM's semantics, or nullptr when the operands do
+// not fit it (including integer division by zero). Also used to fold constants.
+Object* evaluate_binary(Opcode opcode, Object* left, Object* right);
+
 class FemiraVirtualMachine 
 {
     private:
-        Bytecode running_bytecode;
+        const Bytecode* running_bytecode = nullptr;
         stack<Object*> run_stack;
 
+        // grows while the program runs as lazily compiled bodies add their constants
+        const ConstantPool* constant_pool;
+
         int instruction_pointer = 0;
+
+        void trace_bytecode(const Bytecode& bytecode);
+        void trace_registers(const RegisterCode& code);
+
+        // pops the arguments of function into its slots in locals or by name into memory
+        void bind_arguments(Function* function, Memory* memory, vector<Object*>& locals);
+
+        // runs function with the arguments on the stack, its result is left there
+        void call_function(Function* function, const bool trace);
+
+        Object* read_index(Object* object, Object* index);
+        void set_index(Object* object, Object* index, Object* value);
+
+        // by slot when object has the layout, by the field name otherwise
+        Object* read_field(Object* object, RecordLayout* layout, int slot);
+        void set_field(Object* object, RecordLayout* layout, int slot, Object* value);
+
+        void print_object(Object* object);
     public:
         map<int, Bytecode> callable_bytecodes;
+
+        FemiraVirtualMachine(const ConstantPool* constant_pool) { this->constant_pool = constant_pool; };
         
-        void runf_bytecode(const Bytecode bytecode, const bool trace = false, Memory* memory = new Memory());
+        // locals is the frame of the running code, indexed by OP_LOAD_LOCAL / OP_STORE_LOCAL
+        void runf_bytecode(const Bytecode& bytecode, const bool trace = false, Memory* memory = new Memory(), vector<Object*> locals = {});
+
+        // the register VM, locals become the first registers of the frame
+        void run_registers(const RegisterCode& code, const bool trace = false, Memory* memory = new Memory(), vector<Object*> locals = {});
         void errorf(const string text);
 
         void push_stack(Object* data);
@@ -2,44 +2,128 @@
 #include <chrono>
 #include <fstream>
 #include <string>
+#include <thread>
+#include <memory>
+#include <cctype>
+#include <cstdlib>
 
 #include "include/vm.h"
+#include "include/source.h"
 #include "compiler/include/lexer.h"
 #include "compiler/include/parser.h"
 #include "compiler/include/compiler_main.h"
+#include "compiler/include/optimizer.h"
+#include "compiler/include/register_ir.h"
 
 using namespace std;
 
+// below this size spawning lexer threads costs more than it saves
+const size_t PARALLEL_LEXING_THRESHOLD = 1024 * 1024;
+const size_t PARALLEL_PARSING_THRESHOLD = 256 * 1024;
+
 int main(int argc, char** argv)
 {
-    ifstream f(argv[1]);
+    string script;
+    bool show_bytecode = false;
+    bool lazy_functions = false;
+    bool stream_tokens = false;
+    bool use_registers = false;
+    int optimization_level = 1;
+    int inline_threshold = -1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string argument = argv[i];
+
+        if (argument == "--lazy") lazy_functions = true;
+        else if (argument == "--stream") stream_tokens = true;
+        else if (argument == "--registers") use_registers = true;
+        else if (argument.size() == 3 && argument.rfind("-O", 0) == 0 && isdigit(argument[2])) optimization_level = argument[2] - '0';
+        else if (argument.rfind("--inline=", 0) == 0) inline_threshold = atoi(argument.c_str() + 9);
+        else if (script.empty()) script = argument;
+        else if (argument == "yes") show_bytecode = true;
+    }
+
+    SourceFile source;
 
-    if (!f.is_open()) {
+    if (script.empty() || !source.load(script)) {
         cerr << "Cannot run the script" << endl;;
         return 1;
     }
 
-    string s;
-    string code;
+    Lexer lexer(source.view(), false);
 
-    while (getline(f, s)) code += s;
+    // the AST lives in the parser's arena; with --lazy, function bodies are parsed
+    // while the program runs, otherwise it is released as soon as bytecode exists
+    unique_ptr<Parser> parser;
+    BlockNode* ast;
 
-    f.close();
+    if (stream_tokens)
+    {
+        // tokens are lexed while parsing, so the whole token vector never exists
+        parser = make_unique<Parser>(&lexer);
+        ast = parser->make_ast(false);
+    } else
+    {
+        vector<Token> tokens;
 
-    Lexer lexer(code, false);
-    Parser parser(lexer.make_tokens());
-    BlockNode* ast = parser.make_ast(false);
+        if (source.view().size() >= PARALLEL_LEXING_THRESHOLD) tokens = lexer.make_tokens_parallel(thread::hardware_concurrency());
+        else tokens = lexer.make_tokens();
+
+        bool is_parsing_parallel = tokens.size() >= PARALLEL_PARSING_THRESHOLD;
+
+        parser = make_unique<Parser>(move(tokens), lazy_functions);
+        ast = is_parsing_parallel ? parser->make_ast_parallel(false, thread::hardware_concurrency()) : parser->make_ast(false);
+    }
 
     CompilerMain compiler;
 
+    compiler.set_optimization_level(optimization_level);
+
+    // inlining is an optimization, so -O0 turns it off unless asked for
+    if (inline_threshold >= 0) compiler.set_inline_threshold(inline_threshold);
+    else if (optimization_level == 0) compiler.set_inline_threshold(0);
+
     compiler.node_to_bytecode(ast);
     Bytecode bytecode = compiler.get_generated_bytecode();
 
-    FemiraVirtualMachine vm;
+    OptimizerReport optimizer_report;
+    optimize_bytecode(bytecode, compiler.get_constant_pool(), optimization_level, optimizer_report);
+
+    if (show_bytecode)
+    {
+        cout << "<OPTIMIZER> -O" << optimization_level << ": " << optimizer_report.instructions_before - optimizer_report.instructions_after
+             << " of " << optimizer_report.instructions_before << " instructions removed" << endl;
+
+        for (const string& inlined_call: compiler.get_inlined_calls()) cout << "<INLINER> " << inlined_call << endl;
+
+        // lazily compiled bodies add theirs when they are first called
+        cout << "<CONSTANTS> " << compiler.get_constant_pool().constants.size() << " constants in the pool" << endl;
+    }
+
+    // code the register VM cannot run stays on the stack VM
+    shared_ptr<RegisterCode> register_code;
+
+    if (use_registers)
+    {
+        RegisterReport register_report;
+
+        register_code = lower_to_registers(bytecode, compiler.get_constant_pool(), compiler.get_locals_count());
+        lower_functions(bytecode, compiler.get_constant_pool(), register_report);
+
+        if (show_bytecode)
+        {
+            cout << "<REGISTERS> program " << (register_code ? "lowered" : "kept on the stack VM") << ", " << register_report.lowered_functions
+                 << " of " << register_report.functions << " eagerly compiled functions lowered" << endl;
+        }
+    }
+
+    if (!lazy_functions) parser.reset();
 
-    string show_bytecode = argc > 2 ? argv[2] : "";
+    FemiraVirtualMachine vm(&compiler.get_constant_pool());
 
-    vm.runf_bytecode(bytecode, show_bytecode == "yes" ? true : false);
+    if (register_code) vm.run_registers(*register_code, show_bytecode, new Memory(), vector<Object*>(compiler.get_locals_count()));
+    else vm.runf_bytecode(bytecode, show_bytecode, new Memory(), vector<Object*>(compiler.get_locals_count()));
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,102 @@
+#include <string>
+#include <string_view>
+#include <fstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "include/source.h"
+
+using namespace std;
+
+#ifndef _WIN32
+
+bool SourceFile::load(const string& path)
+{
+    int descriptor = open(path.c_str(), O_RDONLY);
+    if (descriptor < 0) return false;
+
+    struct stat info;
+    if (fstat(descriptor, &info) != 0)
+    {
+        close(descriptor);
+        return false;
+    }
+
+    this->size = info.st_size;
+
+    if (this->size == 0)
+    {
+        close(descriptor);
+        return true;
+    }
+
+    void* mapped = mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+
+    if (mapped != MAP_FAILED)
+    {
+        madvise(mapped, this->size, MADV_SEQUENTIAL);
+
+        this->data = static_cast<const char*>(mapped);
+        this->is_mapped = true;
+
+        close(descriptor);
+        return true;
+    }
+
+    this->buffer.resize(this->size);
+
+    size_t loaded = 0;
+    while (loaded < this->size)
+    {
+        ssize_t count = read(descriptor, &this->buffer[loaded], this->size - loaded);
+        if (count <= 0) break;
+
+        loaded += count;
+    }
+
+    close(descriptor);
+
+    this->buffer.resize(loaded);
+    this->data = this->buffer.data();
+    this->size = loaded;
+
+    return true;
+}
+
+SourceFile::~SourceFile()
+{
+    if (this->is_mapped) munmap(const_cast<char*>(this->data), this->size);
+}
+
+#else
+
+bool SourceFile::load(const string& path)
+{
+    ifstream f(path, ios::binary | ios::ate);
+    if (!f.is_open()) return false;
+
+    this->buffer.resize(f.tellg());
+
+    f.seekg(0);
+    f.read(&this->buffer[0], this->buffer.size());
+
+    this->buffer.resize(f.gcount());
+    this->data = this->buffer.data();
+    this->size = this->buffer.size();
+
+    return true;
+}
+
+SourceFile::~SourceFile() {}
+
+#endif
+
+string_view SourceFile::view() const
+{
+    return string_view(this->data, this->size);
+}
@@ -5,6 +5,7 @@
 #include <chrono>
 #include <thread>
 #include <algorithm>
+#include <cstring>
 
 #include "include/vm.h"
 
@@ -44,47 +45,328 @@ map<Opcode, string> opcode_to_string = {
     { OP_READINDEX, "readindex" },
 
     { OP_NEWARRAY, "newarray" },
-    { OP_NEWOBJECT, "newobject" }
+    { OP_NEWOBJECT, "newobject" },
+
+    { OP_LOAD_LOCAL, "load_local" },
+    { OP_STORE_LOCAL, "store_local" },
+
+    { OP_DUP, "dup" },
+
+    { OP_MAKE_ARRAY, "make_array" },
+    { OP_MAKE_OBJECT, "make_object" },
+
+    { OP_ADD_INT, "add_int" },
+    { OP_SUB_INT, "sub_int" },
+    { OP_MUL_INT, "mul_int" },
+    { OP_DIV_INT, "div_int" },
+    { OP_LT_INT, "lt_int" },
+    { OP_GT_INT, "gt_int" },
+    { OP_LE_INT, "le_int" },
+    { OP_GE_INT, "ge_int" },
+
+    { OP_ADD_DOUBLE, "add_double" },
+    { OP_SUB_DOUBLE, "sub_double" },
+    { OP_MUL_DOUBLE, "mul_double" },
+    { OP_DIV_DOUBLE, "div_double" },
+    { OP_LT_DOUBLE, "lt_double" },
+    { OP_GT_DOUBLE, "gt_double" },
+    { OP_LE_DOUBLE, "le_double" },
+    { OP_GE_DOUBLE, "ge_double" },
+
+    { OP_JUMPIFNOT_BOOL, "jumpifnot_bool" },
+
+    { OP_INC_LOCAL, "inc_local" },
+    { OP_DEC_LOCAL, "dec_local" },
+
+    { OP_TAILCALL, "tailcall" },
+    { OP_MAKE_RECORD, "make_record" },
+    { OP_GETFIELD, "getfield" },
+    { OP_SETFIELD, "setfield" }
 };
 
-void FemiraVirtualMachine::runf_bytecode(const Bytecode bytecode, const bool trace, Memory* memory) 
+template <typename T, typename Value>
+Object* evaluate_numbers(Opcode opcode, Value left, Value right)
 {
-    this->instruction_pointer = 0;
-    this->running_bytecode = bytecode;
+    switch (opcode)
+    {
+        case OP_ADD:
+        case OP_ADD_INT:
+        case OP_ADD_DOUBLE:
+            return new T(left + right);
+        case OP_SUB:
+        case OP_SUB_INT:
+        case OP_SUB_DOUBLE:
+            return new T(left - right);
+        case OP_MUL:
+        case OP_MUL_INT:
+        case OP_MUL_DOUBLE:
+            return new T(left * right);
+        case OP_DIV:
+        case OP_DIV_INT:
+        case OP_DIV_DOUBLE:
+            return new T(left / right);
+        case OP_BIGGER:
+        case OP_GT_INT:
+        case OP_GT_DOUBLE:
+            return new Boolean(left > right);
+        case OP_SMALLER:
+        case OP_LT_INT:
+        case OP_LT_DOUBLE:
+            return new Boolean(left < right);
+        case OP_BIGGEROREQ:
+        case OP_GE_INT:
+        case OP_GE_DOUBLE:
+            return new Boolean(left >= right);
+        case OP_SMALLEROREQ:
+        case OP_LE_INT:
+        case OP_LE_DOUBLE:
+            return new Boolean(left <= right);
+        default:
+            return nullptr;
+    }
+}
+
+int ConstantPool::add(Object* value)
+{
+    this->constants.push_back(value);
+
+    return this->constants.size() - 1;
+}
+
+int ConstantPool::intern_string(const string& value)
+{
+    auto found = this->strings.find(value);
+    if (found != this->strings.end()) return found->second;
+
+    return this->strings[value] = this->add(new String(value));
+}
+
+int ConstantPool::intern(Object* value)
+{
+    if (String* string = dynamic_cast<String*>(value))
+    {
+        auto found = this->strings.find(string->data);
+        if (found != this->strings.end()) return found->second;
+
+        return this->strings[string->data] = this->add(value);
+    }
+
+    if (Integer* integer = dynamic_cast<Integer*>(value))
+    {
+        auto found = this->integers.find(integer->data);
+        if (found != this->integers.end()) return found->second;
+
+        return this->integers[integer->data] = this->add(value);
+    }
 
-    if (trace)
+    if (Double* number = dynamic_cast<Double*>(value))
     {
-        cout << "<BYTECODE>" << endl;
+        unsigned long long bits;
+        memcpy(&bits, &number->data, sizeof(bits));
+
+        auto found = this->doubles.find(bits);
+        if (found != this->doubles.end()) return found->second;
+
+        return this->doubles[bits] = this->add(value);
+    }
+
+    if (Boolean* boolean = dynamic_cast<Boolean*>(value))
+    {
+        int& index = this->booleans[boolean->data ? 1 : 0];
+        if (index < 0) index = this->add(value);
+
+        return index;
+    }
 
-        for (Instruction instruction: bytecode)
+    if (dynamic_cast<Null*>(value))
+    {
+        if (this->null < 0) this->null = this->add(value);
+
+        return this->null;
+    }
+
+    return this->add(value);
+}
+
+Object* evaluate_binary(Opcode opcode, Object* left, Object* right)
+{
+    switch (opcode)
+    {
+        case OP_EQ:
+            return new Boolean(right->is_eq(left));
+        case OP_NOTEQ:
+            return new Boolean(!right->is_eq(left));
+        case OP_AND:
+        case OP_OR:
+            {
+                Boolean* left_boolean = dynamic_cast<Boolean*>(left);
+                Boolean* right_boolean = dynamic_cast<Boolean*>(right);
+
+                if (!left_boolean || !right_boolean) return nullptr;
+
+                if (opcode == OP_AND) return new Boolean(left_boolean->data && right_boolean->data);
+                return new Boolean(left_boolean->data || right_boolean->data);
+            }
+        default:
+            break;
+    }
+
+    if (Integer* left_integer = dynamic_cast<Integer*>(left))
+    {
+        if (Integer* right_integer = dynamic_cast<Integer*>(right))
         {
-            Opcode opcode = instruction.opcode;
-            Object* data = instruction.data;
-            cout << opcode << ":    " + opcode_to_string[opcode] << "    " << (data ? data->tostring() : "") << endl;
+            if (opcode == OP_DIV && right_integer->data == 0) return nullptr;
+
+            return evaluate_numbers<Integer>(opcode, left_integer->data, right_integer->data);
         }
+    } else if (Double* left_double = dynamic_cast<Double*>(left))
+    {
+        if (Double* right_double = dynamic_cast<Double*>(right))
+        {
+            return evaluate_numbers<Double>(opcode, left_double->data, right_double->data);
+        }
+    }
+
+    return nullptr;
+}
+
+string binary_operation_error(Opcode opcode, Object* left, Object* right)
+{
+    string operands = "operands " + right->tostring() + " and " + left->tostring() + " are incompatible";
+
+    switch (opcode)
+    {
+        case OP_ADD:
+            return "Add operation error, " + operands;
+        case OP_SUB:
+            return "Substract operation error, " + operands;
+        case OP_MUL:
+            return "Multiply operation error, " + operands;
+        case OP_DIV:
+            {
+                Integer* divisor = dynamic_cast<Integer*>(right);
+
+                if (divisor && divisor->data == 0 && dynamic_cast<Integer*>(left)) return "Divide operation error, integer division by zero";
+                return "Divide operation error, " + operands;
+            }
+        case OP_AND:
+            return "Operator '&' can compare only booleans";
+        case OP_OR:
+            return "Operator '|' can compare only booleans";
+        case OP_BIGGER:
+            return "> operator can work only with integers / doubles";
+        case OP_SMALLER:
+            return "< operator can work only with integers / doubles";
+        case OP_BIGGEROREQ:
+            return ">= operator can work only with integers / doubles";
+        case OP_SMALLEROREQ:
+            return "<= operator can work only with integers / doubles";
+        default:
+            return "Unknown binary operation";
+    }
+}
+
+// opcodes whose operand is a jump offset, a slot or a count rather than an index
+// of their data in the constant pool
+bool has_operand(Opcode opcode)
+{
+    switch (opcode)
+    {
+        case OP_JUMP:
+        case OP_JUMPIFNOT:
+        case OP_JUMPIFNOT_BOOL:
+        case OP_LOAD_LOCAL:
+        case OP_STORE_LOCAL:
+        case OP_INC_LOCAL:
+        case OP_DEC_LOCAL:
+        case OP_MAKE_ARRAY:
+        case OP_MAKE_OBJECT:
+        case OP_CALL:
+        case OP_TAILCALL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// the constant, name or field an instruction refers to through the constant pool,
+// empty when it refers to none
+string describe_constant(Opcode opcode, int operand, const vector<Object*>& constants)
+{
+    switch (opcode)
+    {
+        case OP_PUSHV:
+        case OP_READ_DATA:
+        case OP_WRITE_DATA:
+        case OP_MAKE_RECORD:
+            return constants[operand]->tostring();
+        case OP_GETFIELD:
+        case OP_SETFIELD:
+            return to_string(field_slot(operand)) + "    " + constants[field_layout_index(operand)]->tostring();
+        default:
+            return "";
+    }
+}
+
+void FemiraVirtualMachine::trace_bytecode(const Bytecode& bytecode)
+{
+    cout << "<BYTECODE>" << endl;
+
+    for (Instruction instruction: bytecode)
+    {
+        Opcode opcode = instruction.opcode;
+
+        string operand = has_operand(opcode) ? to_string(instruction.operand) : describe_constant(opcode, instruction.operand, this->constant_pool->constants);
+
+        cout << opcode << ":    " + opcode_to_string[opcode] << "    " << operand << endl;
+    }
+
+    cout << "<RESULT>" << endl;
+}
 
-        cout << "<RESULT>" << endl;
+void FemiraVirtualMachine::bind_arguments(Function* function, Memory* memory, vector<Object*>& locals)
+{
+    // the last argument is on top of the stack
+    for (int i = function->args_ids.size() - 1; i >= 0; i--)
+    {
+        Object* argument = this->pop_stack();
+
+        if (function->args_slots[i] >= 0) locals[function->args_slots[i]] = argument;
+        else memory->write_data(function->args_ids[i], argument);
     }
+}
 
-    while (this->instruction_pointer < this->running_bytecode.size())
+void FemiraVirtualMachine::runf_bytecode(const Bytecode& bytecode, const bool trace, Memory* memory, vector<Object*> locals) 
+{
+    this->instruction_pointer = 0;
+    this->running_bytecode = &bytecode;
+
+    if (trace) this->trace_bytecode(bytecode);
+
+    const vector<Object*>& constants = this->constant_pool->constants;
+
+    while (this->instruction_pointer < this->running_bytecode->size())
     {
-        Instruction instruction = this->running_bytecode.at(this->instruction_pointer);
+        const Instruction& instruction = (*this->running_bytecode)[this->instruction_pointer];
 
         Opcode opcode = instruction.opcode;
-        Object* data = instruction.data;
 
         switch (opcode)
         {
             case OP_WRITE_DATA:
                 {
-                    Object* address = data;
+                    Object* address = constants[instruction.operand];
                     Object* data = this->pop_stack();
 
                     if (String* string = dynamic_cast<String*>(address)) 
                     {
                         memory->write_data(string->data, data);
 
-                        if (Function* function = dynamic_cast<Function*>(data)) function->defined_in = memory;
+                        if (Function* function = dynamic_cast<Function*>(data))
+                        {
+                            function->defined_in = memory;
+                            memory->is_captured = true;
+                        }
 
                         break;
                     } else errorf("Address for data write must be a string");
@@ -92,7 +374,7 @@ void FemiraVirtualMachine::runf_bytecode(const Bytecode bytecode, const bool tra
                 break;
             case OP_READ_DATA:
                 {
-                    Object* address = data; 
+                    Object* address = constants[instruction.operand];
                     
                     if (String* string = dynamic_cast<String*>(address)) 
                     {
@@ -100,404 +382,659 @@ void FemiraVirtualMachine::runf_bytecode(const Bytecode bytecode, const bool tra
                     } else this->errorf("Address for data read must be a string");
                 }
                 break;
-            case OP_JUMP:
+            case OP_LOAD_LOCAL:
                 {
-                    if (Integer* integer = dynamic_cast<Integer*>(data)) 
+                    Object* value = locals[instruction.operand];
+                    if (!value) this->errorf("Local variable is read before it is assigned");
+
+                    this->push_stack(value);
+                }
+                break;
+            case OP_STORE_LOCAL:
+                {
+                    Object* value = this->pop_stack();
+
+                    locals[instruction.operand] = value;
+
+                    if (Function* function = dynamic_cast<Function*>(value))
                     {
-                        this->instruction_pointer += integer->data;
-                        break;
+                        function->defined_in = memory;
+                        memory->is_captured = true;
                     }
+                }
+                break;
+            case OP_INC_LOCAL:
+            case OP_DEC_LOCAL:
+                {
+                    Object*& value = locals[instruction.operand];
+                    if (!value) this->errorf("Local variable is read before it is assigned");
 
-                    this->errorf("Jump error, operand must be a integer");
+                    // values may be shared with other variables, so the counter gets a new one
+                    value = new Integer(static_cast<Integer*>(value)->data + (opcode == OP_INC_LOCAL ? 1 : -1));
+                }
+                break;
+            case OP_JUMP:
+                {
+                    this->instruction_pointer += instruction.operand;
                 }
                 break;
             case OP_JUMPIFNOT:
                 {
-                    if (Integer* integer = dynamic_cast<Integer*>(data)) 
+                    if (Boolean* boolean = dynamic_cast<Boolean*>(this->pop_stack()))
                     {
-                        if (Boolean* boolean = dynamic_cast<Boolean*>(this->pop_stack()))
-                        {
-                            if (!boolean->data) {
-                                this->instruction_pointer += integer->data;
-                            }
+                        if (!boolean->data) this->instruction_pointer += instruction.operand;
 
-                            break;
-                        }
+                        break;
                     }
 
-                    this->errorf("Jumpifnot error, operand must be a integer and condition must be a boolean");
+                    this->errorf("Jumpifnot error, condition must be a boolean");
+                }
+                break;
+            case OP_JUMPIFNOT_BOOL:
+                {
+                    if (!static_cast<Boolean*>(this->pop_stack())->data) this->instruction_pointer += instruction.operand;
                 }
                 break;
             case OP_CALL:
                 {
-                    Object* data = this->pop_stack();
+                    if (Function* function = dynamic_cast<Function*>(this->pop_stack())) this->call_function(function, trace);
+                    else this->errorf("No function to call in stack");
+                }
+                break;
+            case OP_TAILCALL:
+                {
+                    // only emitted in function bodies that define no functions, so unless a
+                    // stored function value runs in it, nothing else refers to this frame's
+                    // memory and it can be refilled for the callee
+                    Function* function = dynamic_cast<Function*>(this->pop_stack());
+                    if (!function) this->errorf("No function to call in stack");
+
+                    if (memory->is_captured)
+                    {
+                        this->call_function(function, trace);
+                        return;
+                    }
 
-                    if (Function* function = dynamic_cast<Function*>(data)) 
+                    if (function->compile_body)
                     {
-                        int ip = this->instruction_pointer;
+                        function->compile_body(function);
+                        function->compile_body = nullptr;
+                    }
 
-                        Memory* defined_in_memory = function->defined_in;
-                        Memory* new_memory = new Memory();
+                    vector<Memory*>& sub_memories = memory->parent->sub_memories;
+                    sub_memories.erase(find(sub_memories.begin(), sub_memories.end(), memory));
 
-                        for (pair<string, Object*> cell: (function->defined_in->cells)) new_memory->write_data(cell.first, cell.second);
+                    memory->parent = nullptr;
+                    memory->cells.clear();
 
-                        reverse(function->args_ids.begin(), function->args_ids.end());
+                    for (pair<string, Object*> cell: (function->defined_in->cells)) memory->write_data(cell.first, cell.second);
 
-                        for (string id: function->args_ids)
-                        {
-                            new_memory->write_data(id, this->pop_stack());
-                        }
+                    vector<Object*> new_locals(function->locals_count);
+
+                    this->bind_arguments(function, memory, new_locals);
+
+                    function->defined_in->sub_memories.push_back(memory);
+                    memory->parent = function->defined_in;
 
-                        defined_in_memory->sub_memories.push_back(new_memory);
-                        new_memory->parent = defined_in_memory;
+                    locals = move(new_locals);
 
-                        this->runf_bytecode(function->bytecode, trace, new_memory);
+                    this->running_bytecode = &function->bytecode;
+                    if (trace) this->trace_bytecode(function->bytecode);
 
-                        this->running_bytecode = bytecode;
-                        this->instruction_pointer = ip;
+                    // the increment below starts the callee at its first instruction
+                    this->instruction_pointer = -1;
+                }
+                break;
+            case OP_PUSHV:
+                {
+                    this->push_stack(constants[instruction.operand]);
+                }
+                break;
+            case OP_DUP:
+                {
+                    if (this->run_stack.empty()) this->errorf("Stack is empty");
 
-                        delete new_memory;
-                    } else this->errorf("No function to call in stack");
+                    this->push_stack(this->run_stack.top());
                 }
                 break;
+            case OP_RETURN:
+                return;
             case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_AND:
+            case OP_OR:
+            case OP_EQ:
+            case OP_NOTEQ:
+            case OP_BIGGER:
+            case OP_SMALLER:
+            case OP_BIGGEROREQ:
+            case OP_SMALLEROREQ:
                 {
-                    Object* obj1 = this->pop_stack();
-                    Object* obj2 = this->pop_stack();
+                    Object* right = this->pop_stack();
+                    Object* left = this->pop_stack();
 
-                    if (Integer* integer = dynamic_cast<Integer*>(obj1)) 
-                    {
-                        if (Integer* integer2 = dynamic_cast<Integer*>(obj2)) 
-                        {
-                            this->push_stack(new Integer(integer->data + integer2->data));
-                            break;
-                        }
-                    } else if (Double* double_value = dynamic_cast<Double*>(obj1)) 
-                    {
-                        if (Double* double_value2 = dynamic_cast<Double*>(obj2)) 
-                        {
-                            this->push_stack(new Double(double_value->data + double_value2->data));
-                            break;
-                        }
-                    }
+                    Object* result = evaluate_binary(opcode, left, right);
+                    if (!result) this->errorf(binary_operation_error(opcode, left, right));
 
-                    this->errorf("Add operation error, operands " + obj1->tostring() + " and " + obj2->tostring() + " are incompatible");
+                    this->push_stack(result);
                 }
                 break;
-            case OP_SUB:
+            case OP_ADD_INT:
+            case OP_SUB_INT:
+            case OP_MUL_INT:
+            case OP_DIV_INT:
+            case OP_LT_INT:
+            case OP_GT_INT:
+            case OP_LE_INT:
+            case OP_GE_INT:
                 {
-                    Object* obj1 = this->pop_stack();
-                    Object* obj2 = this->pop_stack();
+                    int right = static_cast<Integer*>(this->pop_stack())->data;
+                    int left = static_cast<Integer*>(this->pop_stack())->data;
 
-                    if (Integer* integer = dynamic_cast<Integer*>(obj1)) 
-                    {
-                        if (Integer* integer2 = dynamic_cast<Integer*>(obj2)) 
-                        {
-                            this->push_stack(new Integer(integer2->data - integer->data));
-                            break;
-                        }
-                    } else if (Double* double_value = dynamic_cast<Double*>(obj1)) 
-                    {
-                        if (Double* double_value2 = dynamic_cast<Double*>(obj2)) 
-                        {
-                            this->push_stack(new Double(double_value2->data - double_value->data));
-                            break;
-                        }
-                    }
+                    if (opcode == OP_DIV_INT && right == 0) this->errorf("Divide operation error, integer division by zero");
 
-                    this->errorf("Substract operation error, operands " + obj1->tostring() + " and " + obj2->tostring() + " are incompatible");
+                    this->push_stack(evaluate_numbers<Integer>(opcode, left, right));
                 }
                 break;
-            case OP_MUL:
+            case OP_ADD_DOUBLE:
+            case OP_SUB_DOUBLE:
+            case OP_MUL_DOUBLE:
+            case OP_DIV_DOUBLE:
+            case OP_LT_DOUBLE:
+            case OP_GT_DOUBLE:
+            case OP_LE_DOUBLE:
+            case OP_GE_DOUBLE:
                 {
-                    Object* obj1 = this->pop_stack();
-                    Object* obj2 = this->pop_stack();
+                    double right = static_cast<Double*>(this->pop_stack())->data;
+                    double left = static_cast<Double*>(this->pop_stack())->data;
 
-                    if (Integer* integer = dynamic_cast<Integer*>(obj1)) 
-                    {
-                        if (Integer* integer2 = dynamic_cast<Integer*>(obj2)) 
-                        {
-                            this->push_stack(new Integer(integer->data * integer2->data));
-                            break;
-                        }
-                    } else if (Double* double_value = dynamic_cast<Double*>(obj1)) 
-                    {
-                        if (Double* double_value2 = dynamic_cast<Double*>(obj2)) 
-                        {
-                            this->push_stack(new Double(double_value->data * double_value2->data));
-                            break;
-                        }
-                    }
+                    this->push_stack(evaluate_numbers<Double>(opcode, left, right));
+                }
+                break;
+            case OP_PRINT:
+                {
+                    this->print_object(this->pop_stack());
+                }
+                break;
+            case OP_NEWARRAY:
+                {
+                    this->push_stack(new Array());
+                }
+                break;
+            case OP_NEWOBJECT:
+                {
+                    this->push_stack(new ObjectDataStructure());
+                }
+                break;
+            case OP_MAKE_ARRAY:
+                {
+                    int elements_count = instruction.operand;
+
+                    Array* array = new Array();
+                    array->elements.resize(elements_count);
+
+                    // the last element is on top of the stack
+                    for (int i = elements_count - 1; i >= 0; i--) array->elements[i] = this->pop_stack();
 
-                    this->errorf("Multiply operation error, operands " + obj1->tostring() + " and " + obj2->tostring() + " are incompatible");
+                    this->push_stack(array);
                 }
                 break;
-            case OP_DIV:
+            case OP_MAKE_OBJECT:
                 {
-                    Object* obj1 = this->pop_stack();
-                    Object* obj2 = this->pop_stack();
+                    int fields_count = instruction.operand;
+
+                    vector<pair<Object*, Object*>> fields(fields_count);
 
-                    if (Integer* integer = dynamic_cast<Integer*>(obj1)) 
+                    for (int i = fields_count - 1; i >= 0; i--)
                     {
-                        if (Integer* integer2 = dynamic_cast<Integer*>(obj2)) 
-                        {
-                            this->push_stack(new Integer(integer2->data / integer->data));
-                            break;
-                        }
-                    } else if (Double* double_value = dynamic_cast<Double*>(obj1)) 
+                        fields[i].second = this->pop_stack();
+                        fields[i].first = this->pop_stack();
+                    }
+
+                    ObjectDataStructure* object = new ObjectDataStructure();
+
+                    // in source order, so a repeated field keeps its last value
+                    for (pair<Object*, Object*>& field: fields)
                     {
-                        if (Double* double_value2 = dynamic_cast<Double*>(obj2)) 
-                        {
-                            this->push_stack(new Double(double_value2->data / double_value->data));
-                            break;
-                        }
+                        String* name = dynamic_cast<String*>(field.first);
+                        if (!name) this->errorf("Object field name must be a string");
+
+                        object->fields[name->data] = field.second;
                     }
 
-                    this->errorf("Divide operation error, operands " + obj1->tostring() + " and " + obj2->tostring() + " are incompatible");
+                    this->push_stack(object);
                 }
                 break;
-            case OP_PUSHV:
+            case OP_MAKE_RECORD:
                 {
-                    this->push_stack(data);
+                    Record* record = new Record(static_cast<RecordLayout*>(constants[instruction.operand]));
+
+                    // values come in slot order, the last one on top of the stack
+                    for (int i = record->values.size() - 1; i >= 0; i--) record->values[i] = this->pop_stack();
+
+                    this->push_stack(record);
                 }
                 break;
-            case OP_RETURN:
-                return;
-            case OP_AND:
+            case OP_GETFIELD:
                 {
-                    Object* obj1 = this->pop_stack();
-                    Object* obj2 = this->pop_stack();
+                    Object* object = this->pop_stack();
 
-                    if (Boolean* object1 = dynamic_cast<Boolean*>(obj1))
-                    {
-                        if (Boolean* object2 = dynamic_cast<Boolean*>(obj2))
-                        {
-                            this->push_stack(new Boolean(object1->data && object2->data));
-                            break;
-                        }
-                    }
+                    RecordLayout* layout = static_cast<RecordLayout*>(constants[field_layout_index(instruction.operand)]);
 
-                    this->errorf("Operator '&' can compare only booleans");
+                    this->push_stack(this->read_field(object, layout, field_slot(instruction.operand)));
                 }
                 break;
-            case OP_OR:
+            case OP_SETFIELD:
                 {
-                    Object* obj1 = this->pop_stack();
-                    Object* obj2 = this->pop_stack();
+                    Object* object = this->pop_stack();
+                    Object* value = this->pop_stack();
 
-                    if (Boolean* object1 = dynamic_cast<Boolean*>(obj1))
-                    {
-                        if (Boolean* object2 = dynamic_cast<Boolean*>(obj2))
-                        {
-                            this->push_stack(new Boolean(object1->data || object2->data));
-                            break;
-                        }
-                    }
+                    RecordLayout* layout = static_cast<RecordLayout*>(constants[field_layout_index(instruction.operand)]);
 
-                    this->errorf("Operator '|' can compare only booleans");
+                    this->set_field(object, layout, field_slot(instruction.operand), value);
                 }
                 break;
-            case OP_EQ:
+            case OP_SETINDEX:
                 {
-                    Object* obj1 = this->pop_stack();
-                    Object* obj2 = this->pop_stack();
+                    Object* object = this->pop_stack();
+                    Object* value = this->pop_stack();
+                    Object* index = this->pop_stack();
+                    
+                    this->set_index(object, index, value);
+                }
+                break;
+            case OP_READINDEX:
+                {
+                    Object* object = this->pop_stack();
+                    Object* index = this->pop_stack();
+                    
+                    this->push_stack(this->read_index(object, index));
+                }
+                break;
+            case OP_WAIT:
+                {
+                    Object* object = this->pop_stack();
 
-                    this->push_stack(new Boolean(obj1->is_eq(obj2)));
+                    if (Integer* integer = dynamic_cast<Integer*>(object)) this_thread::sleep_for(chrono::duration<int>(integer->data));
+                    else if (Double* double_value = dynamic_cast<Double*>(object)) this_thread::sleep_for(chrono::duration<double>(double_value->data));
                 }
                 break;
-            case OP_NOTEQ:
+            default:
+                break;
+        }
+
+        this->instruction_pointer++;
+    }
+}
+
+void FemiraVirtualMachine::call_function(Function* function, const bool trace)
+{
+    if (function->compile_body)
+    {
+        function->compile_body(function);
+        function->compile_body = nullptr;
+    }
+
+    const Bytecode* caller_bytecode = this->running_bytecode;
+    int ip = this->instruction_pointer;
+
+    Memory* defined_in_memory = function->defined_in;
+    Memory* new_memory = new Memory();
+
+    for (pair<string, Object*> cell: (function->defined_in->cells)) new_memory->write_data(cell.first, cell.second);
+
+    vector<Object*> new_locals(function->locals_count);
+
+    this->bind_arguments(function, new_memory, new_locals);
+
+    defined_in_memory->sub_memories.push_back(new_memory);
+    new_memory->parent = defined_in_memory;
+
+    if (function->register_code) this->run_registers(*function->register_code, trace, new_memory, move(new_locals));
+    else this->runf_bytecode(function->bytecode, trace, new_memory, move(new_locals));
+
+    this->running_bytecode = caller_bytecode;
+    this->instruction_pointer = ip;
+
+    // tail calls in the callee may have moved its memory under another function
+    vector<Memory*>& sub_memories = new_memory->parent->sub_memories;
+    sub_memories.erase(find(sub_memories.begin(), sub_memories.end(), new_memory));
+
+    delete new_memory;
+}
+
+Object* FemiraVirtualMachine::read_index(Object* object, Object* index)
+{
+    if (Array* array = dynamic_cast<Array*>(object)) 
+    {
+        if (Integer* index_integer = dynamic_cast<Integer*>(index)) return array->elements.at(index_integer->data);
+    } else if (ObjectDataStructure* object_data_struct = dynamic_cast<ObjectDataStructure*>(object))
+    {
+        if (String* index_string = dynamic_cast<String*>(index)) return object_data_struct->fields.at(index_string->data);
+    } else if (Record* record = dynamic_cast<Record*>(object))
+    {
+        if (String* index_string = dynamic_cast<String*>(index)) return record->values[record->layout->slots.at(index_string->data)];
+    }
+
+    this->errorf("Readindex error! Object must be a array or object data struct, index must be string or integer");
+
+    return nullptr;
+}
+
+void FemiraVirtualMachine::set_index(Object* object, Object* index, Object* value)
+{
+    if (Array* array = dynamic_cast<Array*>(object)) 
+    {
+        if (Integer* index_integer = dynamic_cast<Integer*>(index))
+        {
+            array->elements.resize(index_integer->data + 1);
+            array->elements[index_integer->data] = value;
+            return;
+        }
+    } else if (ObjectDataStructure* object_data_struct = dynamic_cast<ObjectDataStructure*>(object))
+    {
+        if (String* index_string = dynamic_cast<String*>(index))
+        {
+            object_data_struct->fields[index_string->data] = value;
+            return;
+        }
+    } else if (Record* record = dynamic_cast<Record*>(object))
+    {
+        if (String* index_string = dynamic_cast<String*>(index))
+        {
+            auto slot = record->layout->slots.find(index_string->data);
+            if (slot == record->layout->slots.end()) this->errorf("Setindex error! " + record->layout->type_name + " has no field " + index_string->data);
+
+            record->values[slot->second] = value;
+            return;
+        }
+    }
+
+    this->errorf("Setindex error! Object must be a arrray or object data struct, index must be string or integer");
+}
+
+Object* FemiraVirtualMachine::read_field(Object* object, RecordLayout* layout, int slot)
+{
+    Record* record = dynamic_cast<Record*>(object);
+
+    if (record && record->layout == layout) return record->values[slot];
+
+    return this->read_index(object, layout->fields[slot]);
+}
+
+void FemiraVirtualMachine::set_field(Object* object, RecordLayout* layout, int slot, Object* value)
+{
+    Record* record = dynamic_cast<Record*>(object);
+
+    if (record && record->layout == layout) record->values[slot] = value;
+    else this->set_index(object, layout->fields[slot], value);
+}
+
+void FemiraVirtualMachine::print_object(Object* object)
+{
+    string to_print = object->tostring();
+
+    cout << " ";
+
+    cout << endl;
+
+    cout << " | " + to_print + " | " << endl;
+
+    cout << " ";
+
+    cout << endl;
+}
+
+void FemiraVirtualMachine::trace_registers(const RegisterCode& code)
+{
+    cout << "<REGISTERS>" << endl;
+
+    for (const RegisterInstruction& instruction: code.instructions)
+    {
+        Opcode opcode = instruction.opcode;
+        bool is_jump = opcode == OP_JUMP || opcode == OP_JUMPIFNOT || opcode == OP_JUMPIFNOT_BOOL;
+
+        string constant = describe_constant(opcode, instruction.right, this->constant_pool->constants);
+
+        cout << opcode << ":    " + opcode_to_string[opcode] << "    " << (is_jump ? "@" : "r") << instruction.target << " r" << instruction.left << " r" << instruction.right
+             << (constant.empty() ? "" : "    " + constant) << endl;
+    }
+
+    cout << "<RESULT>" << endl;
+}
+
+void FemiraVirtualMachine::run_registers(const RegisterCode& code, const bool trace, Memory* memory, vector<Object*> registers)
+{
+    registers.resize(code.registers_count);
+    copy(code.constants.begin(), code.constants.end(), registers.begin() + code.constants_base);
+
+    const vector<Object*>& constants = this->constant_pool->constants;
+
+    if (trace) this->trace_registers(code);
+
+    // only locals can be empty, temporaries and constants always hold a value
+    auto read = [this, &registers](int index) {
+        Object* value = registers[index];
+        if (!value) this->errorf("Local variable is read before it is assigned");
+
+        return value;
+    };
+
+    int size = code.instructions.size();
+
+    for (int ip = 0; ip < size; ip++)
+    {
+        const RegisterInstruction& instruction = code.instructions[ip];
+
+        Opcode opcode = instruction.opcode;
+
+        switch (opcode)
+        {
+            case OP_LOAD_LOCAL:
                 {
-                    Object* obj1 = this->pop_stack();
-                    Object* obj2 = this->pop_stack();
+                    registers[instruction.target] = read(instruction.left);
+                }
+                break;
+            case OP_STORE_LOCAL:
+                {
+                    Object* value = read(instruction.left);
+
+                    registers[instruction.target] = value;
 
-                    this->push_stack(new Boolean(!obj1->is_eq(obj2)));
+                    if (Function* function = dynamic_cast<Function*>(value)) function->defined_in = memory;
                 }
                 break;
-            case OP_BIGGER:
+            case OP_INC_LOCAL:
+            case OP_DEC_LOCAL:
                 {
-                    Object* obj1 = this->pop_stack();
-                    Object* obj2 = this->pop_stack();
+                    Object* value = read(instruction.target);
 
-                    if (Integer* integer = dynamic_cast<Integer*>(obj1)) 
-                    {
-                        if (Integer* integer2 = dynamic_cast<Integer*>(obj2)) 
-                        {
-                            this->push_stack(new Boolean(integer2->data > integer->data));
-                            break;
-                        }
-                    } else if (Double* double_value = dynamic_cast<Double*>(obj1)) 
-                    {
-                        if (Double* double_value2 = dynamic_cast<Double*>(obj2)) 
-                        {
-                            this->push_stack(new Boolean(double_value2->data > double_value->data));
-                            break;
-                        }
-                    }
+                    registers[instruction.target] = new Integer(static_cast<Integer*>(value)->data + (opcode == OP_INC_LOCAL ? 1 : -1));
+                }
+                break;
+            case OP_READ_DATA:
+                {
+                    registers[instruction.target] = memory->read_data(static_cast<String*>(constants[instruction.right])->data);
+                }
+                break;
+            case OP_WRITE_DATA:
+                {
+                    Object* value = read(instruction.left);
+
+                    memory->write_data(static_cast<String*>(constants[instruction.right])->data, value);
 
-                    this->errorf("> operator can work only with integers / doubles");
+                    if (Function* function = dynamic_cast<Function*>(value)) function->defined_in = memory;
                 }
                 break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_AND:
+            case OP_OR:
+            case OP_EQ:
+            case OP_NOTEQ:
+            case OP_BIGGER:
             case OP_SMALLER:
+            case OP_BIGGEROREQ:
+            case OP_SMALLEROREQ:
                 {
-                    Object* obj1 = this->pop_stack();
-                    Object* obj2 = this->pop_stack();
+                    Object* left = read(instruction.left);
+                    Object* right = read(instruction.right);
 
-                    if (Integer* integer = dynamic_cast<Integer*>(obj1)) 
-                    {
-                        if (Integer* integer2 = dynamic_cast<Integer*>(obj2)) 
-                        {
-                            this->push_stack(new Boolean(integer2->data < integer->data));
-                            break;
-                        }
-                    } else if (Double* double_value = dynamic_cast<Double*>(obj1)) 
-                    {
-                        if (Double* double_value2 = dynamic_cast<Double*>(obj2)) 
-                        {
-                            this->push_stack(new Boolean(double_value2->data < double_value->data));
-                            break;
-                        }
-                    }
+                    Object* result = evaluate_binary(opcode, left, right);
+                    if (!result) this->errorf(binary_operation_error(opcode, left, right));
 
-                    this->errorf("< operator can work only with integers / doubles");
+                    registers[instruction.target] = result;
                 }
                 break;
-            case OP_BIGGEROREQ:
+            case OP_ADD_INT:
+            case OP_SUB_INT:
+            case OP_MUL_INT:
+            case OP_DIV_INT:
+            case OP_LT_INT:
+            case OP_GT_INT:
+            case OP_LE_INT:
+            case OP_GE_INT:
                 {
-                    Object* obj1 = this->pop_stack();
-                    Object* obj2 = this->pop_stack();
+                    int left = static_cast<Integer*>(read(instruction.left))->data;
+                    int right = static_cast<Integer*>(read(instruction.right))->data;
 
-                    if (Integer* integer = dynamic_cast<Integer*>(obj1)) 
-                    {
-                        if (Integer* integer2 = dynamic_cast<Integer*>(obj2)) 
-                        {
-                            this->push_stack(new Boolean(integer2->data >= integer->data));
-                            break;
-                        }
-                    } else if (Double* double_value = dynamic_cast<Double*>(obj1)) 
-                    {
-                        if (Double* double_value2 = dynamic_cast<Double*>(obj2)) 
-                        {
-                            this->push_stack(new Boolean(double_value2->data >= double_value->data));
-                            break;
-                        }
-                    }
+                    if (opcode == OP_DIV_INT && right == 0) this->errorf("Divide operation error, integer division by zero");
 
-                    this->errorf(">= operator can work only with integers / doubles");
+                    registers[instruction.target] = evaluate_numbers<Integer>(opcode, left, right);
                 }
                 break;
-            case OP_SMALLEROREQ:
+            case OP_ADD_DOUBLE:
+            case OP_SUB_DOUBLE:
+            case OP_MUL_DOUBLE:
+            case OP_DIV_DOUBLE:
+            case OP_LT_DOUBLE:
+            case OP_GT_DOUBLE:
+            case OP_LE_DOUBLE:
+            case OP_GE_DOUBLE:
                 {
-                    Object* obj1 = this->pop_stack();
-                    Object* obj2 = this->pop_stack();
+                    double left = static_cast<Double*>(read(instruction.left))->data;
+                    double right = static_cast<Double*>(read(instruction.right))->data;
 
-                    if (Integer* integer = dynamic_cast<Integer*>(obj1)) 
-                    {
-                        if (Integer* integer2 = dynamic_cast<Integer*>(obj2)) 
-                        {
-                            this->push_stack(new Boolean(integer2->data <= integer->data));
-                            break;
-                        }
-                    } else if (Double* double_value = dynamic_cast<Double*>(obj1)) 
-                    {
-                        if (Double* double_value2 = dynamic_cast<Double*>(obj2)) 
-                        {
-                            this->push_stack(new Boolean(double_value2->data <= double_value->data));
-                            break;
-                        }
-                    }
+                    registers[instruction.target] = evaluate_numbers<Double>(opcode, left, right);
+                }
+                break;
+            case OP_JUMP:
+                {
+                    ip = instruction.target - 1;
+                }
+                break;
+            case OP_JUMPIFNOT:
+                {
+                    Boolean* boolean = dynamic_cast<Boolean*>(read(instruction.left));
+                    if (!boolean) this->errorf("Jumpifnot error, condition must be a boolean");
 
-                    this->errorf("<= operator can work only with integers / doubles");
+                    if (!boolean->data) ip = instruction.target - 1;
                 }
                 break;
-            case OP_PRINT:
+            case OP_JUMPIFNOT_BOOL:
                 {
-                    Object* obj = this->pop_stack();
-                    string to_print = obj->tostring();
+                    if (!static_cast<Boolean*>(read(instruction.left))->data) ip = instruction.target - 1;
+                }
+                break;
+            case OP_CALL:
+                {
+                    Function* function = dynamic_cast<Function*>(read(instruction.left));
+                    if (!function) this->errorf("No function to call in stack");
 
-                    cout << " ";
+                    size_t stack_size = this->run_stack.size();
 
-                    cout << endl;
+                    for (int i = 0; i < instruction.right; i++) this->push_stack(read(instruction.target + i));
 
-                    cout << " | " + to_print + " | " << endl;
+                    this->call_function(function, trace);
 
-                    cout << " ";
+                    // a function that ends without return leaves nothing
+                    registers[instruction.target] = this->run_stack.size() > stack_size ? this->pop_stack() : new Null();
+                }
+                break;
+            case OP_MAKE_ARRAY:
+                {
+                    Array* array = new Array();
+
+                    for (int i = 0; i < instruction.right; i++) array->elements.push_back(read(instruction.target + i));
 
-                    cout << endl;
+                    registers[instruction.target] = array;
                 }
                 break;
-            case OP_NEWARRAY:
+            case OP_MAKE_OBJECT:
                 {
-                    this->push_stack(new Array());
+                    ObjectDataStructure* object = new ObjectDataStructure();
+
+                    for (int i = 0; i < instruction.right; i++)
+                    {
+                        String* name = dynamic_cast<String*>(read(instruction.target + 2 * i));
+                        if (!name) this->errorf("Object field name must be a string");
+
+                        object->fields[name->data] = read(instruction.target + 2 * i + 1);
+                    }
+
+                    registers[instruction.target] = object;
                 }
                 break;
-            case OP_NEWOBJECT:
+            case OP_READINDEX:
                 {
-                    this->push_stack(new ObjectDataStructure());
+                    registers[instruction.target] = this->read_index(read(instruction.left), read(instruction.right));
                 }
                 break;
             case OP_SETINDEX:
                 {
-                    Object* object = this->pop_stack();
-                    Object* value = this->pop_stack();
-                    Object* index = this->pop_stack();
-                    
-                    if (Array* array = dynamic_cast<Array*>(object)) 
-                    {
-                        if (Integer* index_integer = dynamic_cast<Integer*>(index))
-                        {
-                            array->elements.resize(index_integer->data + 1);
-                            array->elements[index_integer->data] = value;
-                            break;
-                        }
-                    } else if (ObjectDataStructure* object_data_struct = dynamic_cast<ObjectDataStructure*>(object))
-                    {
-                        if (String* index_string = dynamic_cast<String*>(index))
-                        {
-                            object_data_struct->fields[index_string->data] = value;
-                            break;
-                        }
-                    }
+                    this->set_index(read(instruction.target), read(instruction.left), read(instruction.right));
+                }
+                break;
+            case OP_MAKE_RECORD:
+                {
+                    Record* record = new Record(static_cast<RecordLayout*>(constants[instruction.right]));
+
+                    int count = record->values.size();
 
-                    this->errorf("Setindex error! Object must be a arrray or object data struct, index must be string or integer");
+                    for (int i = 0; i < count; i++) record->values[i] = read(instruction.target + i);
+
+                    registers[instruction.target] = record;
                 }
                 break;
-            case OP_READINDEX:
+            case OP_GETFIELD:
                 {
-                    Object* object = this->pop_stack();
-                    Object* index = this->pop_stack();
-                    
-                    if (Array* array = dynamic_cast<Array*>(object)) 
-                    {
-                        if (Integer* index_integer = dynamic_cast<Integer*>(index))
-                        {
-                            this->push_stack(array->elements.at(index_integer->data));
-                            break;
-                        }
-                    } else if (ObjectDataStructure* object_data_struct = dynamic_cast<ObjectDataStructure*>(object))
-                    {
-                        if (String* index_string = dynamic_cast<String*>(index))
-                        {
-                            this->push_stack(object_data_struct->fields.at(index_string->data));
-                            break;
-                        }
-                    }
+                    RecordLayout* layout = static_cast<RecordLayout*>(constants[field_layout_index(instruction.right)]);
 
-                    this->errorf("Readindex error! Object must be a array or object data struct, index must be string or integer");
+                    registers[instruction.target] = this->read_field(read(instruction.left), layout, field_slot(instruction.right));
+                }
+                break;
+            case OP_SETFIELD:
+                {
+                    RecordLayout* layout = static_cast<RecordLayout*>(constants[field_layout_index(instruction.right)]);
+
+                    this->set_field(read(instruction.target), layout, field_slot(instruction.right), read(instruction.left));
+                }
+                break;
+            case OP_PRINT:
+                {
+                    this->print_object(read(instruction.left));
                 }
                 break;
             case OP_WAIT:
                 {
-                    Object* object = this->pop_stack();
+                    Object* object = read(instruction.left);
 
                     if (Integer* integer = dynamic_cast<Integer*>(object)) this_thread::sleep_for(chrono::duration<int>(integer->data));
                     else if (Double* double_value = dynamic_cast<Double*>(object)) this_thread::sleep_for(chrono::duration<double>(double_value->data));
                 }
                 break;
+            case OP_RETURN:
+                {
+                    this->push_stack(read(instruction.left));
+                }
+                return;
             default:
                 break;
         }
-
-        this->instruction_pointer++;
     }
 }
 
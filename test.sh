@@ -0,0 +1,12 @@
+g++ src/main.cpp src/source.cpp src/vm.cpp src/compiler/lexer.cpp src/compiler/scanner.cpp src/compiler/parser.cpp src/compiler/compiler_main.cpp src/compiler/optimizer.cpp src/compiler/register_ir.cpp -pthread -o compilers/femira.out || exit 1
+# every script in src/test has to print its .expected output in every execution mode
+status=0
+for script in src/test/*.fmr; do
+    for mode in "" "-O0" "-O2" "--inline=0" "--lazy" "--stream" "--registers" "--registers -O0" "--registers --lazy"; do
+        if ! ./compilers/femira.out $script $mode 2>&1 | cmp -s - ${script%.fmr}.expected; then
+            echo "FAIL: $script $mode"
+            status=1
+        fi
+    done
+done
+exit $status